@@ -0,0 +1,262 @@
+/* Sloppy - attacks.c
+   Attack tables for the sliding pieces (bishops, rooks and queens)
+
+   Copyright (C) 2007 Ilari Pihlajisto (ilari.pihlajisto@mbnet.fi)
+
+   Sloppy is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Sloppy is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "sloppy.h"
+#include "debug.h"
+#include "util.h"
+#include "attacks.h"
+
+
+/* Sizes of the shared attack tables. Both the fancy magics and PEXT
+   use exactly 2^(num. of relevant occupancy bits) entries per square.  */
+#define B_TABLE_SIZE 5248
+#define R_TABLE_SIZE 102400
+
+/* Slow attack generators from magicmoves.c, used for filling the tables.  */
+extern U64 initmagicmoves_Bmoves(const int square, const U64 occ);
+extern U64 initmagicmoves_Rmoves(const int square, const U64 occ);
+
+typedef U64 (*SlowAttackFunc)(const int square, const U64 occ);
+
+SqAttacks fancy_b_atk[64];
+SqAttacks fancy_r_atk[64];
+static U64 fancy_b_table[B_TABLE_SIZE];
+static U64 fancy_r_table[R_TABLE_SIZE];
+static bool fancy_init_done = false;
+
+#ifdef __BMI2__
+SqAttacks pext_b_atk[64];
+SqAttacks pext_r_atk[64];
+static U64 pext_b_table[B_TABLE_SIZE];
+static U64 pext_r_table[R_TABLE_SIZE];
+static bool pext_init_done = false;
+#endif /* __BMI2__ */
+
+static bool magicmoves_init_done = false;
+
+
+/* Fill the fancy magic tables for one piece type.
+   The magics, masks and shifts are the same ones magicmoves uses.  */
+static void
+init_fancy_table(SqAttacks *sq_atk, U64 *table, int table_size,
+                 const U64 *masks, const U64 *magics,
+                 const unsigned *shifts, SlowAttackFunc slow_attacks)
+{
+	int sq;
+	int offset = 0;
+
+	for (sq = 0; sq < 64; sq++) {
+		U64 occ = 0;
+		SqAttacks *sa = &sq_atk[sq];
+
+		sa->mask = masks[sq];
+		sa->magic = magics[sq];
+		sa->shift = shifts[sq];
+		sa->attacks = table + offset;
+		offset += 1 << (64 - sa->shift);
+		if (offset > table_size)
+			fatal_error("Fancy magic table overflow");
+
+		/* Loop through all subsets of the mask.  */
+		do {
+			sa->attacks[(occ * sa->magic) >> sa->shift] =
+				slow_attacks(sq, occ);
+			occ = (occ - sa->mask) & sa->mask;
+		} while (occ);
+	}
+}
+
+#ifdef __BMI2__
+/* Fill the PEXT tables for one piece type.  */
+static void
+init_pext_table(SqAttacks *sq_atk, U64 *table, int table_size,
+                const U64 *masks, SlowAttackFunc slow_attacks)
+{
+	int sq;
+	int offset = 0;
+
+	for (sq = 0; sq < 64; sq++) {
+		U64 occ = 0;
+		SqAttacks *sa = &sq_atk[sq];
+
+		sa->mask = masks[sq];
+		sa->magic = 0;
+		sa->shift = 64 - popcount(sa->mask);
+		sa->attacks = table + offset;
+		offset += 1 << (64 - sa->shift);
+		if (offset > table_size)
+			fatal_error("PEXT table overflow");
+
+		do {
+			sa->attacks[_pext_u64(occ, sa->mask)] =
+				slow_attacks(sq, occ);
+			occ = (occ - sa->mask) & sa->mask;
+		} while (occ);
+	}
+}
+#endif /* __BMI2__ */
+
+static void
+init_magicmoves(void)
+{
+	if (magicmoves_init_done)
+		return;
+	initmagicmoves();
+	magicmoves_init_done = true;
+}
+
+static void
+init_fancy(void)
+{
+	if (fancy_init_done)
+		return;
+	init_fancy_table(fancy_b_atk, fancy_b_table, B_TABLE_SIZE,
+	                 magicmoves_b_mask, magicmoves_b_magics,
+	                 magicmoves_b_shift, initmagicmoves_Bmoves);
+	init_fancy_table(fancy_r_atk, fancy_r_table, R_TABLE_SIZE,
+	                 magicmoves_r_mask, magicmoves_r_magics,
+	                 magicmoves_r_shift, initmagicmoves_Rmoves);
+	fancy_init_done = true;
+}
+
+#ifdef __BMI2__
+static void
+init_pext(void)
+{
+	if (pext_init_done)
+		return;
+	init_pext_table(pext_b_atk, pext_b_table, B_TABLE_SIZE,
+	                magicmoves_b_mask, initmagicmoves_Bmoves);
+	init_pext_table(pext_r_atk, pext_r_table, R_TABLE_SIZE,
+	                magicmoves_r_mask, initmagicmoves_Rmoves);
+	pext_init_done = true;
+}
+#endif /* __BMI2__ */
+
+void
+init_attacks(void)
+{
+#if defined(ATTACKS_PEXT)
+	init_pext();
+#elif defined(ATTACKS_FANCY)
+	init_fancy();
+#else /* magicmoves */
+	init_magicmoves();
+#endif
+}
+
+
+/* Number of random positions and iterations in attacks_bench().  */
+#define BENCH_NPOS 0x10000
+#define BENCH_NLOOPS 64
+
+static U64
+rand64(void)
+{
+	return ((U64)my_rand() << 40) ^ ((U64)my_rand() << 20) ^ (U64)my_rand();
+}
+
+/* Run the lookups of one backend, and print the lookup speed. The
+   checksum of all the attack masks keeps the lookups from being
+   optimized away.  */
+#define BENCH_BACKEND(name, b_lookup, r_lookup) do { \
+	int i_, j_; \
+	S64 t_; \
+	U64 sum_ = 0; \
+	t_ = get_ms(); \
+	for (j_ = 0; j_ < BENCH_NLOOPS; j_++) { \
+		for (i_ = 0; i_ < BENCH_NPOS; i_++) { \
+			sum_ += b_lookup(sqs[i_], occs[i_]); \
+			sum_ += r_lookup(sqs[i_], occs[i_]); \
+		} \
+	} \
+	t_ = get_ms() - t_; \
+	if (t_ <= 0) \
+		t_ = 1; \
+	printf("%-14s %6.1f M lookups/sec (checksum %016" PRIx64 ")\n", \
+	       name, (2.0 * BENCH_NPOS * BENCH_NLOOPS) / (t_ * 1000.0), sum_); \
+} while (0)
+
+#define MM_B(sq, occ) B_MAGIC(sq, occ)
+#define MM_R(sq, occ) R_MAGIC(sq, occ)
+#define FANCY_B(sq, occ) FANCY_ATTACKS(fancy_b_atk, sq, occ)
+#define FANCY_R(sq, occ) FANCY_ATTACKS(fancy_r_atk, sq, occ)
+#ifdef __BMI2__
+  #define PEXT_B(sq, occ) PEXT_ATTACKS(pext_b_atk, sq, occ)
+  #define PEXT_R(sq, occ) PEXT_ATTACKS(pext_r_atk, sq, occ)
+#endif /* __BMI2__ */
+
+void
+attacks_bench(void)
+{
+	int i;
+	int nerrors = 0;
+	int *sqs;
+	U64 *occs;
+
+	init_magicmoves();
+	init_fancy();
+#ifdef __BMI2__
+	init_pext();
+#endif /* __BMI2__ */
+
+	sqs = malloc(BENCH_NPOS * sizeof(int));
+	occs = malloc(BENCH_NPOS * sizeof(U64));
+	if (sqs == NULL || occs == NULL)
+		fatal_perror("Can't allocate memory for the benchmark");
+
+	/* Random occupancies with about 25% of the squares occupied.  */
+	for (i = 0; i < BENCH_NPOS; i++) {
+		sqs[i] = my_rand() & 63;
+		occs[i] = rand64() & rand64();
+	}
+
+	/* Make sure all the backends give the same results.  */
+	for (i = 0; i < BENCH_NPOS; i++) {
+		U64 b = initmagicmoves_Bmoves(sqs[i], occs[i]);
+		U64 r = initmagicmoves_Rmoves(sqs[i], occs[i]);
+
+		if (MM_B(sqs[i], occs[i]) != b || MM_R(sqs[i], occs[i]) != r)
+			nerrors++;
+		if (FANCY_B(sqs[i], occs[i]) != b
+		||  FANCY_R(sqs[i], occs[i]) != r)
+			nerrors++;
+#ifdef __BMI2__
+		if (PEXT_B(sqs[i], occs[i]) != b
+		||  PEXT_R(sqs[i], occs[i]) != r)
+			nerrors++;
+#endif /* __BMI2__ */
+	}
+	if (nerrors > 0)
+		my_error("%d attack table errors", nerrors);
+
+	printf("Attack table backend in use: %s\n", ATTACKS_NAME);
+	BENCH_BACKEND("magicmoves", MM_B, MM_R);
+	BENCH_BACKEND("fancy magics", FANCY_B, FANCY_R);
+#ifdef __BMI2__
+	BENCH_BACKEND("PEXT", PEXT_B, PEXT_R);
+#else /* not __BMI2__ */
+	printf("PEXT           not compiled in (needs -mbmi2)\n");
+#endif /* not __BMI2__ */
+
+	free(sqs);
+	free(occs);
+}
+
@@ -0,0 +1,73 @@
+#ifndef ATTACKS_H
+#define ATTACKS_H
+
+#include "sloppy.h"
+#include "magicmoves.h"
+
+/* Attack tables for the sliding pieces.
+
+   The backend is selected at compile time:
+   - default:		Pradyumna Kannan's magicmoves (magicmoves.c)
+   - ATTACKS_FANCY:	"fancy" magic bitboards: one shared attack table
+			and a per-square struct of mask, magic, shift and
+			table pointer
+   - ATTACKS_PEXT:	BMI2's PEXT instruction indexes the shared table
+			without magic multiplication (needs -mbmi2)
+
+   The rest of Sloppy only uses the B_ATTACKS, R_ATTACKS and Q_ATTACKS
+   macros, so switching the backend doesn't affect anything else.  */
+
+#if defined(ATTACKS_PEXT) && !defined(__BMI2__)
+  #error "ATTACKS_PEXT requires a compiler target with BMI2 (eg. -mbmi2)"
+#endif
+
+/* Attack table lookup data for one square.  */
+typedef struct _SqAttacks
+{
+	U64 mask;	/* relevant occupancy bits */
+	U64 magic;	/* magic multiplier (not used by PEXT) */
+	U64 *attacks;	/* the square's part of the shared attack table */
+	unsigned shift;	/* 64 - num. of index bits */
+} SqAttacks;
+
+#ifdef __BMI2__
+  #include <immintrin.h>
+  extern SqAttacks pext_b_atk[64];
+  extern SqAttacks pext_r_atk[64];
+
+  #define PEXT_ATTACKS(t, sq, occ) \
+	((t)[sq].attacks[_pext_u64((occ), (t)[sq].mask)])
+#endif /* __BMI2__ */
+
+extern SqAttacks fancy_b_atk[64];
+extern SqAttacks fancy_r_atk[64];
+
+#define FANCY_ATTACKS(t, sq, occ) \
+	((t)[sq].attacks[(((occ) & (t)[sq].mask) * (t)[sq].magic) >> (t)[sq].shift])
+
+#if defined(ATTACKS_PEXT)
+  #define ATTACKS_NAME "PEXT"
+  #define B_ATTACKS(sq, occ) PEXT_ATTACKS(pext_b_atk, sq, occ)
+  #define R_ATTACKS(sq, occ) PEXT_ATTACKS(pext_r_atk, sq, occ)
+#elif defined(ATTACKS_FANCY)
+  #define ATTACKS_NAME "fancy magics"
+  #define B_ATTACKS(sq, occ) FANCY_ATTACKS(fancy_b_atk, sq, occ)
+  #define R_ATTACKS(sq, occ) FANCY_ATTACKS(fancy_r_atk, sq, occ)
+#else /* magicmoves */
+  #define ATTACKS_NAME "magicmoves"
+  #define B_ATTACKS(sq, occ) B_MAGIC(sq, occ)
+  #define R_ATTACKS(sq, occ) R_MAGIC(sq, occ)
+#endif
+
+#define Q_ATTACKS(sq, occ) (B_ATTACKS(sq, occ) | R_ATTACKS(sq, occ))
+
+
+/* Initialize the attack tables of the selected backend.  */
+extern void init_attacks(void);
+
+/* Compare the speed of all the attack table backends compiled into
+   Sloppy, and verify that they agree with each other.  */
+extern void attacks_bench(void);
+
+#endif /* ATTACKS_H */
+
@@ -20,27 +20,80 @@
 #include <stdlib.h>
 #include "sloppy.h"
 #include "util.h"
+#include "debug.h"
+#include "book.h"
 #include "avltree.h"
 
 
-/* Write a node and its subtree to a file.  */
+/* The maximum height of a tree. An AVL tree of height h has at least
+   fib(h + 3) - 1 nodes, so 64 levels is more than the memory can hold.  */
+#define AVL_MAX_HEIGHT 64
+
+/* Number of nodes in one block of the node pool.  */
+#define AVL_POOL_SIZE 65536
+
+/* The nodes are allocated from big blocks instead of calling malloc() for
+   every node. Nodes that are allocated together are also close to each
+   other in memory, and the blocks are freed when all the trees are empty.  */
+typedef struct _AvlPool
+{
+	struct _AvlPool *next;
+	AvlNode nodes[AVL_POOL_SIZE];
+} AvlPool;
+
+static AvlPool *pool = NULL;		/* the newest block */
+static int pool_used = 0;		/* nodes used in the newest block */
+static AvlNode *free_nodes = NULL;	/* unallocated nodes of old trees */
+static long nnodes = 0;			/* nodes in use */
+
+
+/* Allocate a new node for <entry> from the node pool.  */
+static AvlNode
+*new_node(const BookEntry *entry)
+{
+	AvlNode *node;
+
+	if (free_nodes != NULL) {
+		node = free_nodes;
+		free_nodes = node->left;
+	} else {
+		if (pool == NULL || pool_used >= AVL_POOL_SIZE) {
+			AvlPool *block;
+
+			if ((block = malloc(sizeof(AvlPool))) == NULL)
+				fatal_error("Couldn't allocate memory");
+			block->next = pool;
+			pool = block;
+			pool_used = 0;
+		}
+		node = &pool->nodes[pool_used++];
+	}
+	nnodes++;
+
+	node->entry = *entry;
+	node->height = 0;
+	node->left = node->right = NULL;
+
+	return node;
+}
+
+/* Write a node and its subtree to a book file.  */
 void
-write_avl(const AvlNode *node, FILE *fp)
+write_avl(const AvlNode *node, struct _BookWriter *bw)
 {
-	if (node != NULL) {
-		/* Make sure the data is in the right endian format.  */
-		U64 key = fix_endian_u64(node->key);
-		U16 games = fix_endian_u16(node->games);
-		U16 wins = fix_endian_u16(node->wins);
-		
-		write_avl(node->left, fp);
-		if (fwrite(&key, sizeof(U64), 1, fp) != 1
-		||  fwrite(&games, sizeof(U16), 1, fp) != 1
-		||  fwrite(&wins, sizeof(U16), 1, fp) != 1) {
-			my_perror("Can't write to file");
-			return;
+	const AvlNode *stack[AVL_MAX_HEIGHT];
+	int depth = 0;
+
+	for (;;) {
+		for (; node != NULL; node = node->left) {
+			ASSERT(1, depth < AVL_MAX_HEIGHT);
+			stack[depth++] = node;
 		}
-		write_avl(node->right, fp);
+		if (depth == 0)
+			break;
+		node = stack[--depth];
+		write_book_entry(bw, &node->entry);
+		node = node->right;
 	}
 }
 
@@ -48,26 +101,62 @@ write_avl(const AvlNode *node, FILE *fp)
 void
 clear_avl(AvlNode *node)
 {
-	if (node != NULL) {
-		clear_avl(node->left);
-		clear_avl(node->right);
-		free(node);
-		node = NULL;
+	AvlNode *stack[AVL_MAX_HEIGHT + 1];
+	int depth = 0;
+
+	if (node != NULL)
+		stack[depth++] = node;
+	while (depth > 0) {
+		node = stack[--depth];
+		if (node->right != NULL)
+			stack[depth++] = node->right;
+		if (node->left != NULL)
+			stack[depth++] = node->left;
+		ASSERT(1, depth <= AVL_MAX_HEIGHT);
+
+		node->left = free_nodes;
+		free_nodes = node;
+		nnodes--;
+	}
+
+	/* If all the trees are empty, give the memory back.  */
+	if (nnodes == 0) {
+		while (pool != NULL) {
+			AvlPool *next = pool->next;
+			free(pool);
+			pool = next;
+		}
+		pool_used = 0;
+		free_nodes = NULL;
 	}
 }
 
-/* Search a tree (node, and its subtree) for a node of a specific key (key).
-   If no match is found, return NULL.  */
+/* Compare a key and a move to the key and the move of a node.  */
+static int
+compare_node(U64 key, U16 move, const AvlNode *node)
+{
+	if (key != node->entry.key)
+		return (key < node->entry.key) ? -1 : 1;
+	if (move != node->entry.move)
+		return (move < node->entry.move) ? -1 : 1;
+	return 0;
+}
+
+/* Search a tree (node, and its subtree) for a node of a specific key (key)
+   and move (move). If no match is found, return NULL.  */
 AvlNode
-*find_avl(const AvlNode *node, U64 key)
+*find_avl(const AvlNode *node, U64 key, U16 move)
 {
-	if (node == NULL)
-		return NULL;
-	if (key < node->key )
-		return find_avl(node->left, key);
-	if (key > node->key)
-		return find_avl(node->right, key);
-	return (AvlNode*)node;
+	int cmp;
+
+	while (node != NULL) {
+		cmp = compare_node(key, move, node);
+		if (cmp == 0)
+			return (AvlNode*)node;
+		node = (cmp < 0) ? node->left : node->right;
+	}
+
+	return NULL;
 }
 
 static int
@@ -147,42 +236,120 @@ static AvlNode
 	return single_rotate_with_right(n1);
 }
 
-/* Insert a new node into an AVL tree.  */
-AvlNode
-*insert_avl(AvlNode *node, U64 key, U16 games, U16 wins)
+/* Rebalance a tree after inserting a node for <entry>. <path> has the
+   links from the root to the parent of the new node, and <depth> is their
+   number. After a rotation or if the height of a subtree doesn't change,
+   the nodes above it don't need any changes.  */
+static void
+rebalance(AvlNode ***path, int depth, const BookEntry *entry)
 {
-	if (node == NULL) {
-		/* Create a new node.  */
-		node = malloc(sizeof(AvlNode));
-		if (node == NULL)
-			fatal_error("Couldn't allocate memory");
-		else {
-			node->key = key;
-			node->games = games;
-			node->wins = wins;
-			node->height = 0;
-			node->left = node->right = NULL;
-		}
-	} else if (key < node->key) {
-		node->left = insert_avl(node->left, key, games, wins);
+	while (depth > 0) {
+		int height;
+		AvlNode **link = path[--depth];
+		AvlNode *node = *link;
+
+		height = node->height;
 		if (avl_height(node->left) - avl_height(node->right) == 2) {
-			if (key < node->left->key)
-				node = single_rotate_with_left(node);
+			if (compare_node(entry->key, entry->move, node->left) < 0)
+				*link = single_rotate_with_left(node);
 			else
-				node = double_rotate_with_left(node);
+				*link = double_rotate_with_left(node);
+			break;
 		}
-	} else if (key > node->key) {
-		node->right = insert_avl(node->right, key, games, wins);
-		if(avl_height(node->right) - avl_height(node->left) == 2) {
-			if(key > node->right->key)
-				node = single_rotate_with_right(node);
+		if (avl_height(node->right) - avl_height(node->left) == 2) {
+			if (compare_node(entry->key, entry->move, node->right) > 0)
+				*link = single_rotate_with_right(node);
 			else
-				node = double_rotate_with_right(node);
+				*link = double_rotate_with_right(node);
+			break;
 		}
+
+		node->height = max_val(avl_height(node->left), avl_height(node->right)) + 1;
+		if (node->height == height)
+			break;
 	}
+}
 
-	node->height = max_val(avl_height(node->left), avl_height(node->right)) + 1;
+/* Insert a new node into an AVL tree.  */
+AvlNode
+*insert_avl(AvlNode *node, const BookEntry *entry)
+{
+	int cmp;
+	int depth = 0;
+	AvlNode *root = node;
+	AvlNode **path[AVL_MAX_HEIGHT + 1];	/* links from the root to the new node */
+	AvlNode **link = &root;
 
-	return node;
+	while (*link != NULL) {
+		if ((cmp = compare_node(entry->key, entry->move, *link)) == 0)
+			return root;
+		ASSERT(1, depth < AVL_MAX_HEIGHT);
+		path[depth++] = link;
+		link = (cmp < 0) ? &(*link)->left : &(*link)->right;
+	}
+	*link = new_node(entry);
+	rebalance(path, depth, entry);
+
+	return root;
 }
 
+/* Read <nentries> entries from a book file whose format is <version>, and
+   build a balanced tree of them. The entries of a book file are sorted,
+   so every node is put in its place without comparing any keys. The
+   left subtree of a node has (n - 1) / 2 of the subtree's n nodes, and
+   the rest go to the right subtree. If the file can't be read, the tree
+   has only the nodes that were read.  */
+AvlNode
+*read_avl(FILE *fp, int version, size_t nentries)
+{
+	struct {
+		size_t n;		/* num. of nodes in the subtree */
+		AvlNode *node;		/* root of the subtree, or NULL */
+	} stack[AVL_MAX_HEIGHT];
+	int depth = 0;
+	size_t n = nentries;
+	AvlNode *node;
+	AvlNode *subtree;	/* the last subtree that was completed */
+	BookEntry entry;
+
+	for (;;) {
+		/* Go down the left edge of a subtree of <n> nodes.  */
+		for (; n > 0; n = (n - 1) / 2) {
+			ASSERT(1, depth < AVL_MAX_HEIGHT);
+			stack[depth].n = n;
+			stack[depth].node = NULL;
+			depth++;
+		}
+		/* Complete the subtrees whose right subtree is ready.  */
+		subtree = NULL;
+		while (depth > 0 && stack[depth - 1].node != NULL) {
+			node = stack[--depth].node;
+			node->right = subtree;
+			node->height = max_val(avl_height(node->left),
+			                       avl_height(node->right)) + 1;
+			subtree = node;
+		}
+		if (depth == 0)
+			break;
+
+		/* The left subtree is ready, so the next entry is the root.  */
+		if (!read_book_entry(fp, version, &entry))
+			break;
+		node = new_node(&entry);
+		node->left = subtree;
+		stack[depth - 1].node = node;
+		n = stack[depth - 1].n - 1 - (stack[depth - 1].n - 1) / 2;
+	}
+
+	/* If the file ended too soon, attach the nodes that were read.  */
+	while (depth > 0) {
+		if ((node = stack[--depth].node) != NULL) {
+			node->right = subtree;
+			node->height = max_val(avl_height(node->left),
+			                       avl_height(node->right)) + 1;
+			subtree = node;
+		}
+	}
+
+	return subtree;
+}
@@ -1,32 +1,37 @@
 #ifndef AVLTREE_H
 #define AVLTREE_H
 
+#include <stdio.h>
 #include "sloppy.h"
+#include "book.h"
 
 
 typedef struct _AvlNode
 {
-	U64 key;		/* hash key */
-	U16 games;		/* number of times the pos was reached */
-	U16 wins;		/* number of times the pos led to a win */
+	BookEntry entry;	/* book position or move */
 	struct _AvlNode *left;
 	struct _AvlNode *right;
 	int height;		/* height of the node's subtree */
 } AvlNode;
 
 
-/* Write a node and its subtree to a file.  */
-extern void write_avl(const AvlNode *node, FILE *fp);
+/* Write a node and its subtree to a book file.  */
+extern void write_avl(const AvlNode *node, struct _BookWriter *bw);
 
 /* Unallocate a node and its subtree.  */
 extern void clear_avl(AvlNode *node);
 
-/* Search a tree (node, and its subtree) for a node of a specific key (key).
-   If no match is found, return NULL.  */
-extern AvlNode *find_avl(const AvlNode *node, U64 key);
+/* Search a tree (node, and its subtree) for a node of a specific key (key)
+   and move (move). If no match is found, return NULL.  */
+extern AvlNode *find_avl(const AvlNode *node, U64 key, U16 move);
 
 /* Insert a new node into an AVL tree.  */
-extern AvlNode *insert_avl(AvlNode *node, U64 key, U16 games, U16 wins);
+extern AvlNode *insert_avl(AvlNode *node, const BookEntry *entry);
+
+/* Read <nentries> entries from a book file whose format is <version>, and
+   build a balanced tree of them. The entries must be sorted. If the file
+   can't be read, the tree has only the nodes that were read.  */
+extern AvlNode *read_avl(FILE *fp, int version, size_t nentries);
 
 #endif /* AVLTREE_H */
 
@@ -24,6 +24,7 @@
 #include "debug.h"
 #include "util.h"
 #include "notation.h"
+#include "hash.h"
 #include "search.h"
 #include "bench.h"
 
@@ -246,5 +247,6 @@ bench(void)
 	printf("Total nodes per second: %d\n", nps);
 	printf("Average branching factor: %.2f\n", avg_bfactor);
 	printf("Hash table hit rate: %.2f%%\n", hhit_rate);
+	print_hash_stats();
 }
 
@@ -1,11 +1,28 @@
 /* Sloppy - book.c
    Functions for creating, searching and updating Sloppy's opening book.
 
-   Sloppy's binary book format:
+   Sloppy's binary book format, version 2:
+     A 16-byte header:
+       char magic[8] -- "SLOPPYBK"
+       U32 version -- the format version, 2
+       U32 count -- the number of entries
+     An entry for every book move, sorted by the key and the move:
+       U64 key -- the hash key of the position before the move
+       U16 move -- the move, see PACK_MOVE()
+       U16 weight -- the score of the move, the best move of the position
+                     has 65535
+       U32 games -- the number of games where the move was played
+       U32 wins -- the number of those games won by the side that moved
+       U32 draws -- the number of those games that were drawn
+   All the moves of a position are next to each other, so they're found
+   with one search.
+
+   Version 1 books have no header, only a list of positions:
      U64 key -- the hash key
      U16 games -- the number of times the position was reached
      U16 wins -- the number of times reaching the position turned into a win
-   This is repeated for every position in the book. All in little-endian.
+   Version 1 books can still be used and updated, but new books are always
+   created in version 2. All in little-endian.
    
 
    Copyright (C) 2007 Ilari Pihlajisto (ilari.pihlajisto@mbnet.fi)
@@ -26,7 +43,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include "sloppy.h"
+
+#ifdef WINDOWS
+#include <windows.h>
+#else /* not WINDOWS */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif /* not WINDOWS */
+
 #include "debug.h"
 #include "util.h"
 #include "avltree.h"
@@ -36,9 +64,105 @@
 #include "book.h"
 
 
+#define BOOK_MAGIC "SLOPPYBK"
+#define BOOK_HEADER_SIZE 16
 #define BOOK_NODE_SIZE (sizeof(U64) + sizeof(U16) + sizeof(U16))
+#define BOOK_ENTRY_SIZE (sizeof(U64) + 2 * sizeof(U16) + 3 * sizeof(U32))
+
+/* The header size and the entry size of a book file of version <v>.  */
+#define HEADER_SIZE(v) ((v) == 1 ? 0 : BOOK_HEADER_SIZE)
+#define ENTRY_SIZE(v) ((v) == 1 ? BOOK_NODE_SIZE : BOOK_ENTRY_SIZE)
+
+/* An opening book file that's mapped to memory (the BOOK_MAP mode).
+   The file is already sorted by the hash keys, so it can be searched
+   as it is, and the operating system shares the pages between all the
+   processes that use the same book.  */
+typedef struct _BookMap
+{
+	const unsigned char *base;	/* the mapped file */
+	size_t size;			/* size of the file */
+	const unsigned char *data;	/* the first entry */
+	size_t npos;			/* num. of entries */
+	int version;			/* book format version */
+#ifdef WINDOWS
+	HANDLE file;
+	HANDLE mapping;
+#endif /* WINDOWS */
+} BookMap;
+
+/* A child position of the current position in a book probe.  */
+typedef struct _BookProbe
+{
+	U64 key;	/* hash key */
+	int index;	/* index of the move in the move list */
+	int score;	/* score of the position, or VAL_NONE */
+} BookProbe;
+
+/* The number of keys in the search cache of the BOOK_DISK mode.  */
+#define BOOK_CACHE_SIZE 0x4000
+
+/* An opening book file that's searched on disk (the BOOK_DISK mode).
+   The file is opened on the first probe and kept open. The book is
+   split into blocks, and the first key of every block is cached, so a
+   probe needs only one read: the block where the key must be.  */
+typedef struct _BookFile
+{
+#ifdef WINDOWS
+	FILE *fp;
+#else /* not WINDOWS */
+	int fd;
+#endif /* not WINDOWS */
+	bool is_open;
+	int version;		/* book format version */
+	size_t npos;		/* num. of entries */
+	size_t block_size;	/* num. of entries per block */
+	size_t nblocks;		/* num. of blocks */
+	U64 *keys;		/* the first key of every block */
+	unsigned char *buf;	/* buffer for reading one block */
+} BookFile;
+
+/* Size of the output buffer of a book writer in bytes.  */
+#define BOOK_WRITE_SIZE 0x10000
+
+/* A book file that's being written. In a version 2 book the moves of
+   the current position are buffered until the next position, so that
+   their weights can be set. The encoded entries are collected in <buf>
+   and written in big blocks.  */
+typedef struct _BookWriter
+{
+	FILE *fp;
+	char filename[MAX_BUF];		/* the book file */
+	char tmp_file[MAX_BUF];		/* the file that's written */
+	int version;			/* book format version */
+	U32 count;			/* num. of entries written */
+	bool error;			/* the file couldn't be written */
+	BookEntry moves[MAX_NMOVES];	/* moves of the current position */
+	int nmoves;			/* num. of moves in <moves> */
+	unsigned char buf[BOOK_WRITE_SIZE];	/* encoded entries */
+	size_t buf_len;			/* num. of bytes in <buf> */
+} BookWriter;
+
+/* The book learning updates that haven't been written to the book file
+   yet. The updates of a game are appended to the log, and merged with
+   the book file by flush_learn_log() when the game ends.  */
+typedef struct _LearnLog
+{
+	BookEntry *entries;	/* the updates */
+	size_t nentries;	/* num. of updates */
+	size_t size;		/* allocated size of <entries> */
+	int version;		/* book format version of the updates */
+} LearnLog;
 
 static bool book_modified = false;
+static int book_version = BOOK_VERSION;
+static LearnLog learn_log;
+#ifdef WINDOWS
+static HANDLE lock_file = INVALID_HANDLE_VALUE;
+#else /* not WINDOWS */
+static int lock_fd = -1;
+#endif /* not WINDOWS */
+static BookMap book_map;
+static BookFile book_file;
 
 
 /* Returns true if <filename> exists.  */
@@ -53,21 +177,181 @@ file_exists(const char *filename)
 	return true;
 }
 
-/* Returns the number of positions in a book file.  */
+/* Returns a little-endian U16 in <buf>.  */
+static U16
+get_u16(const unsigned char *buf)
+{
+	U16 val;
+
+	memcpy(&val, buf, sizeof(U16));
+	return fix_endian_u16(val);
+}
+
+/* Returns a little-endian U32 in <buf>.  */
+static U32
+get_u32(const unsigned char *buf)
+{
+	U32 val;
+
+	memcpy(&val, buf, sizeof(U32));
+	return fix_endian_u32(val);
+}
+
+/* Store <val> in <buf> in little-endian format.  */
+static void
+put_u16(unsigned char *buf, U16 val)
+{
+	val = fix_endian_u16(val);
+	memcpy(buf, &val, sizeof(U16));
+}
+
+/* Store <val> in <buf> in little-endian format.  */
+static void
+put_u32(unsigned char *buf, U32 val)
+{
+	val = fix_endian_u32(val);
+	memcpy(buf, &val, sizeof(U32));
+}
+
+/* Returns the hash key of book entry <index> in <data>, where every
+   entry takes <size> bytes.  */
+static U64
+get_node_key(const unsigned char *data, size_t index, size_t size)
+{
+	U64 key;
+
+	memcpy(&key, data + index * size, sizeof(U64));
+	return fix_endian_u64(key);
+}
+
+/* Saturate the counters of a book position at UINT16_MAX. The win
+   ratio stays the same.  */
+static void
+saturate_counters(U32 *games, U32 *wins)
+{
+	if (*games > UINT16_MAX) {
+		*wins = (U32)(((U64)*wins * UINT16_MAX) / *games);
+		*games = UINT16_MAX;
+	}
+}
+
+/* Read a book entry of a version <version> book from <buf>.  */
+static void
+decode_entry(const unsigned char *buf, int version, BookEntry *entry)
+{
+	entry->key = get_node_key(buf, 0, 0);
+	if (version == 1) {
+		entry->move = 0;
+		entry->weight = 0;
+		entry->games = get_u16(buf + 8);
+		entry->wins = get_u16(buf + 10);
+		entry->draws = 0;
+	} else {
+		entry->move = get_u16(buf + 8);
+		entry->weight = get_u16(buf + 10);
+		entry->games = get_u32(buf + 12);
+		entry->wins = get_u32(buf + 16);
+		entry->draws = get_u32(buf + 20);
+	}
+}
+
+/* Store a book entry of a version <version> book in <buf>. In version 1
+   the counters saturate at UINT16_MAX.  */
+static void
+encode_entry(unsigned char *buf, int version, const BookEntry *entry)
+{
+	U64 key = fix_endian_u64(entry->key);
+
+	memcpy(buf, &key, sizeof(U64));
+	if (version == 1) {
+		U32 games = entry->games;
+		U32 wins = entry->wins;
+
+		saturate_counters(&games, &wins);
+		put_u16(buf + 8, (U16)games);
+		put_u16(buf + 10, (U16)wins);
+	} else {
+		put_u16(buf + 8, entry->move);
+		put_u16(buf + 10, entry->weight);
+		put_u32(buf + 12, entry->games);
+		put_u32(buf + 16, entry->wins);
+		put_u32(buf + 20, entry->draws);
+	}
+}
+
+/* Parse the header of a book file from its first <len> bytes in <buf>.
+   <file_size> is the size of the file. Returns the format version, or -1
+   if the header is invalid, and stores the number of entries in <npos>.  */
 static int
-get_pos_count(FILE *fp)
+parse_header(const unsigned char *buf, size_t len, size_t file_size,
+             size_t *npos)
 {
-	long cur_fpos;
-	long end_fpos;
+	U32 version;
+	U32 count;
+
+	ASSERT(1, buf != NULL);
+	ASSERT(1, npos != NULL);
+
+	/* Version 1 books have no header.  */
+	if (len < BOOK_HEADER_SIZE || memcmp(buf, BOOK_MAGIC, 8) != 0) {
+		*npos = file_size / BOOK_NODE_SIZE;
+		return 1;
+	}
+	version = get_u32(buf + 8);
+	count = get_u32(buf + 12);
+	if (version != BOOK_VERSION
+	||  (file_size - BOOK_HEADER_SIZE) / BOOK_ENTRY_SIZE < count)
+		return -1;
+	*npos = count;
+
+	return (int)version;
+}
+
+/* Read the header of a book file, and leave <fp> at the first entry.
+   Returns the format version of the book, or -1 if the header is invalid.
+   If <npos> isn't NULL, the number of entries is stored in it.  */
+int
+read_book_header(FILE *fp, size_t *npos)
+{
+	long file_size;
+	size_t len;
+	size_t count = 0;
+	int version;
+	unsigned char buf[BOOK_HEADER_SIZE];
 
 	ASSERT(1, fp != NULL);
 
-	cur_fpos = ftell(fp);
 	fseek(fp, 0, SEEK_END);
-	end_fpos = ftell(fp);
-	fseek(fp, cur_fpos, SEEK_SET);
-	
-	return (int)(end_fpos / BOOK_NODE_SIZE);
+	file_size = ftell(fp);
+	rewind(fp);
+
+	/* An empty file can get any version.  */
+	if ((len = fread(buf, 1, BOOK_HEADER_SIZE, fp)) == 0)
+		version = BOOK_VERSION;
+	else if ((version = parse_header(buf, len, (size_t)file_size,
+	                                 &count)) == 1)
+		rewind(fp);
+	if (npos != NULL)
+		*npos = count;
+
+	return version;
+}
+
+/* Read the next entry from a book file whose format is <version>.
+   Returns false at the end of the file, or if the file can't be read.  */
+bool
+read_book_entry(FILE *fp, int version, BookEntry *entry)
+{
+	unsigned char buf[BOOK_ENTRY_SIZE];
+
+	ASSERT(1, fp != NULL);
+	ASSERT(1, entry != NULL);
+
+	if (fread(buf, ENTRY_SIZE(version), 1, fp) != 1)
+		return false;
+	decode_entry(buf, version, entry);
+
+	return true;
 }
 
 /* Read an opening book file and store its positions in an AVL tree.
@@ -75,11 +359,8 @@ get_pos_count(FILE *fp)
 int
 book_to_tree(const char *filename, AvlNode **tree)
 {
-	int i;
-	U16 games;
-	U16 wins;
-	int npos;
-	U64 key;
+	int version;
+	size_t npos;
 	FILE *fp;
 
 	ASSERT(1, filename != NULL);
@@ -89,82 +370,537 @@ book_to_tree(const char *filename, AvlNode **tree)
 		my_perror("Can't open file %s", filename);
 		return -1;
 	}
+	if ((version = read_book_header(fp, &npos)) == -1) {
+		my_close(fp, filename);
+		my_error("Invalid book file %s", filename);
+		return -1;
+	}
 	clear_avl(*tree);
-	*tree = NULL;
 
-	npos = get_pos_count(fp);
-	for (i = 0; i < npos; i++) {
-		if (fread(&key, sizeof(U64), 1, fp) != 1
-		||  fread(&games, sizeof(U16), 1, fp) != 1
-		||  fread(&wins, sizeof(U16), 1, fp) != 1) {
-			my_close(fp, filename);
-			my_perror("Can't read file %s", filename);
+	*tree = read_avl(fp, version, npos);
+	if (ferror(fp)) {
+		my_close(fp, filename);
+		my_perror("Can't read file %s", filename);
+		return -1;
+	}
+	my_close(fp, filename);
+	/* The tree is now the same as the book file.  */
+	book_version = version;
+	book_modified = false;
+
+	return 0;
+}
+
+/* Returns the format version of the book in the AVL tree.  */
+int
+get_book_version(void)
+{
+	return book_version;
+}
+
+/* Unmap the book file mapped by map_book(), if any.  */
+static void
+unmap_book(void)
+{
+	if (book_map.base == NULL)
+		return;
+#ifdef WINDOWS
+	UnmapViewOfFile(book_map.base);
+	CloseHandle(book_map.mapping);
+	CloseHandle(book_map.file);
+#else /* not WINDOWS */
+	munmap((void*)book_map.base, book_map.size);
+#endif /* not WINDOWS */
+	book_map.base = NULL;
+	book_map.data = NULL;
+	book_map.npos = 0;
+}
+
+/* Map an opening book file to memory for the BOOK_MAP book mode.
+   Returns 0 if successfull.  */
+int
+map_book(const char *filename)
+{
+	size_t size;
+
+	ASSERT(1, filename != NULL);
+
+	unmap_book();
+#ifdef WINDOWS
+	{
+		LARGE_INTEGER file_size;
+
+		book_map.file = CreateFile(filename, GENERIC_READ,
+			FILE_SHARE_READ, NULL, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL, NULL);
+		if (book_map.file == INVALID_HANDLE_VALUE) {
+			my_error("Can't open file %s", filename);
+			return -1;
+		}
+		if (!GetFileSizeEx(book_map.file, &file_size)
+		||  file_size.QuadPart < (LONGLONG)BOOK_NODE_SIZE) {
+			CloseHandle(book_map.file);
+			my_error("Invalid book file %s", filename);
+			return -1;
+		}
+		size = (size_t)file_size.QuadPart;
+		book_map.mapping = CreateFileMapping(book_map.file, NULL,
+			PAGE_READONLY, 0, 0, NULL);
+		if (book_map.mapping != NULL)
+			book_map.base = MapViewOfFile(book_map.mapping,
+				FILE_MAP_READ, 0, 0, 0);
+		if (book_map.base == NULL) {
+			if (book_map.mapping != NULL)
+				CloseHandle(book_map.mapping);
+			CloseHandle(book_map.file);
+			my_error("Can't map file %s", filename);
 			return -1;
 		}
-		
-		/* Make sure the data is in the right endian format.  */
-		key = fix_endian_u64(key);
-		games = fix_endian_u16(games);
-		wins = fix_endian_u16(wins);
-		
-		*tree = (AvlNode*)insert_avl(*tree, key, games, wins);
 	}
-	my_close(fp, filename);
+#else /* not WINDOWS */
+	{
+		int fd;
+		struct stat st;
+		void *data;
+
+		if ((fd = open(filename, O_RDONLY)) == -1) {
+			my_perror("Can't open file %s", filename);
+			return -1;
+		}
+		if (fstat(fd, &st) == -1
+		||  st.st_size < (off_t)BOOK_NODE_SIZE) {
+			close(fd);
+			my_error("Invalid book file %s", filename);
+			return -1;
+		}
+		size = (size_t)st.st_size;
+		data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		/* The mapping stays valid after the file is closed.  */
+		close(fd);
+		if (data == MAP_FAILED) {
+			my_perror("Can't map file %s", filename);
+			return -1;
+		}
+		book_map.base = data;
+	}
+#endif /* not WINDOWS */
+	book_map.size = size;
+	book_map.version = parse_header(book_map.base, size, size,
+	                                &book_map.npos);
+	if (book_map.version == -1) {
+		unmap_book();
+		my_error("Invalid book file %s", filename);
+		return -1;
+	}
+	book_map.data = book_map.base + HEADER_SIZE(book_map.version);
 
 	return 0;
 }
 
-/* Give the book position a score based on the number of games and wins.  */
+/* Give the book position a score based on the number of games and wins.
+   The counters of a position in the tree can be bigger than in the
+   book file, so they're saturated the same way.  */
 static int
-get_book_score(U16 games, U16 wins)
+get_book_score(U32 games, U32 wins)
 {
 	ASSERT(2, games > 0);
 
+	saturate_counters(&games, &wins);
 	return (wins * wins) / games;
 }
 
-/* Do a binary search in file <fp> to find the book position with key <key>.
-   If the position is found, return its score. Else return VAL_NONE.  */
+/* Do a binary search in the book entries in <data> to find the last
+   entry whose key is less than or equal to <key>. <npos> is the number
+   of entries, and <size> is the size of an entry. Returns the index of
+   the entry, or 0 if every key is greater than <key>.
+
+   The search has no unpredictable branches: the range is halved until
+   one entry is left, and the new start of the range is selected with
+   a conditional move. The possible entries of the next two steps are
+   prefetched, because with a big book every step is a cache miss.  */
+static size_t
+search_nodes(const unsigned char *data, size_t npos, U64 key, size_t size)
+{
+	size_t base;
+	size_t n;
+
+	ASSERT(2, data != NULL);
+	ASSERT(2, npos > 0);
+
+	base = 0;
+	n = npos;
+	while (n > 1) {
+		size_t half = n / 2;
+
+		PREFETCH(data + (base + half / 2) * size);
+		PREFETCH(data + (base + half + half / 2) * size);
+		base = (get_node_key(data, base + half, size) <= key)
+		     ? base + half : base;
+		n -= half;
+	}
+
+	return base;
+}
+
+/* Returns the score of book position <index> in <data> if its key is
+   <key>, or VAL_NONE if it isn't.  */
 static int
-find_disk_pos(FILE *fp, U64 key, int npos)
+get_node_score(const unsigned char *data, size_t index, U64 key)
 {
-	long left;
-	long right;
-	long mid;
-	U64 tmp_key;
 	U16 games;
 	U16 wins;
 
-	ASSERT(1, fp != NULL);
-	ASSERT(1, npos > 0);
-
-	left = 0;
-	right = npos - 1;
-	/* Seach the positions.  */
-	while (right >= left) {
-		mid = (left + right) / 2;
-		fseek(fp, BOOK_NODE_SIZE * mid, SEEK_SET);
-		if (fread(&tmp_key, sizeof(U64), 1, fp) != 1
-		||  fread(&games, sizeof(U16), 1, fp) != 1
-		||  fread(&wins, sizeof(U16), 1, fp) != 1) {
-			my_perror("Can't read book file");
-			return VAL_NONE;
+	if (get_node_key(data, index, BOOK_NODE_SIZE) != key)
+		return VAL_NONE;
+
+	data += index * BOOK_NODE_SIZE + sizeof(U64);
+	games = get_u16(data);
+	wins = get_u16(data + sizeof(U16));
+
+	return get_book_score(games, wins);
+}
+
+/* Read <len> bytes from offset <offset> of the BOOK_DISK book file
+   to <buf>. Returns true if successfull.  */
+static bool
+read_disk(size_t offset, size_t len, unsigned char *buf)
+{
+#ifdef WINDOWS
+	if (fseek(book_file.fp, (long)offset, SEEK_SET) != 0
+	||  fread(buf, 1, len, book_file.fp) != len)
+		return false;
+#else /* not WINDOWS */
+	while (len > 0) {
+		ssize_t nread = pread(book_file.fd, buf, len, (off_t)offset);
+		if (nread <= 0)
+			return false;
+		buf += nread;
+		len -= nread;
+		offset += nread;
+	}
+#endif /* not WINDOWS */
+
+	return true;
+}
+
+/* Read <count> entries, starting from entry <index>, from the
+   BOOK_DISK book file to <buf>. Returns true if successfull.  */
+static bool
+read_disk_nodes(size_t index, size_t count, unsigned char *buf)
+{
+	size_t size = ENTRY_SIZE(book_file.version);
+
+	return read_disk(HEADER_SIZE(book_file.version) + index * size,
+	                 count * size, buf);
+}
+
+/* Close the BOOK_DISK book file and free its search cache.  */
+static void
+close_disk_book(void)
+{
+	if (!book_file.is_open)
+		return;
+#ifdef WINDOWS
+	fclose(book_file.fp);
+#else /* not WINDOWS */
+	close(book_file.fd);
+#endif /* not WINDOWS */
+	free(book_file.keys);
+	free(book_file.buf);
+	book_file.keys = NULL;
+	book_file.buf = NULL;
+	book_file.is_open = false;
+}
+
+/* Open the book file for the BOOK_DISK mode, and cache the first key
+   of every block. Returns 0 if successfull.  */
+static int
+open_disk_book(const char *filename)
+{
+	size_t i;
+	size_t size;
+	size_t len;
+	size_t buf_size;
+	unsigned char header[BOOK_HEADER_SIZE];
+	unsigned char node[BOOK_ENTRY_SIZE];
+
+	ASSERT(1, filename != NULL);
+	ASSERT(1, !book_file.is_open);
+
+#ifdef WINDOWS
+	if ((book_file.fp = fopen(filename, "rb")) == NULL) {
+		my_perror("Can't open file %s", filename);
+		return -1;
+	}
+	fseek(book_file.fp, 0, SEEK_END);
+	size = (size_t)ftell(book_file.fp);
+#else /* not WINDOWS */
+	{
+		struct stat st;
+
+		if ((book_file.fd = open(filename, O_RDONLY)) == -1) {
+			my_perror("Can't open file %s", filename);
+			return -1;
 		}
-		
-		/* Make sure the data is in the right endian format.  */
-		tmp_key = fix_endian_u64(tmp_key);
-		games = fix_endian_u16(games);
-		wins = fix_endian_u16(wins);
-		
-		if (key < tmp_key)
-			right = mid - 1;
-		else if (key > tmp_key)
-			left = mid + 1;
+		if (fstat(book_file.fd, &st) == -1)
+			st.st_size = 0;
+		size = (size_t)st.st_size;
+	}
+#endif /* not WINDOWS */
+	book_file.is_open = true;
+
+	len = (size < BOOK_HEADER_SIZE) ? size : BOOK_HEADER_SIZE;
+	if (!read_disk(0, len, header)) {
+		close_disk_book();
+		my_perror("Can't read file %s", filename);
+		return -1;
+	}
+	book_file.version = parse_header(header, len, size, &book_file.npos);
+	if (book_file.version == -1) {
+		close_disk_book();
+		my_error("Invalid book file %s", filename);
+		return -1;
+	}
+	/* An empty book stays open, so that it's reported only once and
+	   the probes find no moves.  */
+	if (book_file.npos == 0) {
+		book_file.nblocks = 0;
+		my_error("The opening book %s is empty", filename);
+		return 0;
+	}
+	book_file.block_size = (book_file.npos + BOOK_CACHE_SIZE - 1)
+	                     / BOOK_CACHE_SIZE;
+	book_file.nblocks = (book_file.npos + book_file.block_size - 1)
+	                  / book_file.block_size;
+	/* In a version 2 book the moves of a position may continue
+	   after the block.  */
+	buf_size = book_file.block_size;
+	if (book_file.version > 1)
+		buf_size += MAX_NMOVES;
+	book_file.keys = malloc(book_file.nblocks * sizeof(U64));
+	book_file.buf = malloc(buf_size * ENTRY_SIZE(book_file.version));
+	if (book_file.keys == NULL || book_file.buf == NULL)
+		fatal_error("Couldn't allocate memory");
+
+	for (i = 0; i < book_file.nblocks; i++) {
+		if (!read_disk_nodes(i * book_file.block_size, 1, node)) {
+			close_disk_book();
+			my_perror("Can't read file %s", filename);
+			return -1;
+		}
+		book_file.keys[i] = get_node_key(node, 0, 0);
+	}
+
+	return 0;
+}
+
+/* Find the positions of <probes> in the mapped book file, and store
+   their scores.
+
+   The binary searches of all the probes run in lockstep, one level at a
+   time. The loads of different probes don't depend on each other, so
+   their cache misses overlap, and with sorted keys the probes share the
+   positions at the top levels. Starting each search where the previous
+   one ended would be slower, because the top levels of the shortened
+   searches wouldn't stay in the cache.  */
+static void
+find_map_positions(BookProbe *probes, int nprobes)
+{
+	int i;
+	size_t n;
+	size_t base[MAX_NMOVES];
+	const unsigned char *data = book_map.data;
+
+	ASSERT(2, data != NULL);
+	ASSERT(2, probes != NULL);
+	ASSERT(2, nprobes <= MAX_NMOVES);
+
+	for (i = 0; i < nprobes; i++)
+		base[i] = 0;
+	for (n = book_map.npos; n > 1; n -= n / 2) {
+		size_t half = n / 2;
+
+		for (i = 0; i < nprobes; i++) {
+			U64 key = probes[i].key;
+			size_t mid = base[i] + half;
+
+			base[i] = (get_node_key(data, mid, BOOK_NODE_SIZE) <= key)
+			        ? mid : base[i];
+			PREFETCH(data + (base[i] + (n - half) / 2) * BOOK_NODE_SIZE);
+		}
+	}
+	for (i = 0; i < nprobes; i++)
+		probes[i].score = get_node_score(data, base[i], probes[i].key);
+}
+
+/* Find the positions of <probes> (sorted by key) in the BOOK_DISK book
+   file, and store their scores. The block of every key is found from
+   the cache, and the keys that fall in the same block share one read.  */
+static void
+find_disk_positions(BookProbe *probes, int nprobes)
+{
+	int i;
+	size_t left = 0;
+	size_t count = 0;
+	size_t last_block = book_file.nblocks;
+
+	ASSERT(2, book_file.is_open);
+	ASSERT(2, probes != NULL);
+
+	/* If the file can't be read, the rest of the probes stay empty.  */
+	for (i = 0; i < nprobes; i++)
+		probes[i].score = VAL_NONE;
+	if (book_file.npos == 0)
+		return;
+
+	for (i = 0; i < nprobes; i++) {
+		size_t right;
+		size_t index;
+		U64 key = probes[i].key;
+
+		if (key < book_file.keys[0])
+			continue;
+
+		/* Find the last block whose first key is <= <key>.
+		   The keys are sorted, so the block can't be before
+		   the previous key's block.  */
+		right = book_file.nblocks;
+		while (right - left > 1) {
+			size_t mid = (left + right) / 2;
+			if (book_file.keys[mid] <= key)
+				left = mid;
+			else
+				right = mid;
+		}
+
+		if (left != last_block) {
+			size_t block = left * book_file.block_size;
+
+			count = book_file.npos - block;
+			if (count > book_file.block_size)
+				count = book_file.block_size;
+			if (!read_disk_nodes(block, count, book_file.buf)) {
+				my_perror("Can't read book file");
+				return;
+			}
+			last_block = left;
+		}
+		index = search_nodes(book_file.buf, count, key, BOOK_NODE_SIZE);
+		probes[i].score = get_node_score(book_file.buf, index, key);
+	}
+}
+
+/* Give a book move a score based on the number of games, wins and
+   draws. A draw counts as half a win.  */
+static double
+get_move_score(const BookEntry *entry)
+{
+	double points;
+
+	ASSERT(2, entry != NULL);
+
+	if (entry->games == 0)
+		return 0.0;
+	points = entry->wins + entry->draws / 2.0;
+
+	return (points * points) / entry->games;
+}
+
+/* Set the weights of the <nmoves> moves of a position from their scores.
+   The best move gets the weight 65535.  */
+static void
+set_weights(BookEntry *moves, int nmoves)
+{
+	int i;
+	double max_score = 0.0;
+
+	ASSERT(2, moves != NULL);
+
+	for (i = 0; i < nmoves; i++) {
+		double score = get_move_score(&moves[i]);
+		if (score > max_score)
+			max_score = score;
+	}
+	for (i = 0; i < nmoves; i++) {
+		if (max_score > 0.0)
+			moves[i].weight = (U16)(get_move_score(&moves[i])
+			                  * UINT16_MAX / max_score + 0.5);
 		else
-			return get_book_score(games, wins);
+			moves[i].weight = 0;
 	}
+}
 
-	return VAL_NONE;
+/* Find the moves of position <key> in the version 2 book entries in
+   <data>. <npos> is the number of entries. The moves are stored in
+   <moves>, and their number is returned.  */
+static int
+find_moves(const unsigned char *data, size_t npos, U64 key, BookEntry *moves)
+{
+	int nmoves = 0;
+	size_t i;
+
+	ASSERT(2, moves != NULL);
+
+	if (npos == 0)
+		return 0;
+	/* Find the first entry whose key is >= <key>.  */
+	i = (key > 0) ? search_nodes(data, npos, key - 1, BOOK_ENTRY_SIZE) : 0;
+	if (get_node_key(data, i, BOOK_ENTRY_SIZE) < key)
+		i++;
+
+	for (; i < npos && nmoves < MAX_NMOVES; i++) {
+		if (get_node_key(data, i, BOOK_ENTRY_SIZE) != key)
+			break;
+		decode_entry(data + i * BOOK_ENTRY_SIZE, 2, &moves[nmoves++]);
+	}
+
+	return nmoves;
+}
+
+/* Find the moves of position <key> in the version 2 BOOK_DISK book file.
+   The moves start in the last block whose first key is less than <key>,
+   and there are at most MAX_NMOVES of them, so one read is enough.
+   Returns the number of moves.  */
+static int
+find_disk_moves(U64 key, BookEntry *moves)
+{
+	size_t left = 0;
+	size_t right = book_file.nblocks;
+	size_t start;
+	size_t count;
+
+	ASSERT(2, book_file.is_open);
+	ASSERT(2, moves != NULL);
+
+	if (book_file.npos == 0)
+		return 0;
+	while (right - left > 1) {
+		size_t mid = (left + right) / 2;
+		if (book_file.keys[mid] < key)
+			left = mid;
+		else
+			right = mid;
+	}
+
+	start = left * book_file.block_size;
+	count = book_file.npos - start;
+	if (count > book_file.block_size + MAX_NMOVES)
+		count = book_file.block_size + MAX_NMOVES;
+	if (!read_disk_nodes(start, count, book_file.buf)) {
+		my_perror("Can't read book file");
+		return 0;
+	}
+
+	return find_moves(book_file.buf, count, key, moves);
+}
+
+/* Close the book file that's used by the BOOK_MAP or BOOK_DISK book
+   mode, if any.  */
+void
+close_book(void)
+{
+	unmap_book();
+	close_disk_book();
 }
 
 /* Search the binary tree <book> to find the position with key <key>.
@@ -176,61 +912,159 @@ find_ram_pos(U64 key, const AvlNode *book)
 	
 	ASSERT(2, book != NULL);
 
-	if ((n = (AvlNode*)find_avl(book, key)) != NULL)
-		return get_book_score(n->games, n->wins);
+	if ((n = (AvlNode*)find_avl(book, key, 0)) != NULL)
+		return get_book_score(n->entry.games, n->entry.wins);
 
 	return VAL_NONE;
 }
 
+/* Compare two book probes by their hash keys, for qsort().  */
+static int
+compare_probes(const void *a, const void *b)
+{
+	U64 key1 = ((const BookProbe*)a)->key;
+	U64 key2 = ((const BookProbe*)b)->key;
+
+	if (key1 < key2)
+		return -1;
+	if (key1 > key2)
+		return 1;
+	return 0;
+}
+
+/* Get the scores of the book moves in <move_list> from a version 1 book,
+   where the book has the child positions of the moves.
+   Returns the combined score of all the moves.
+
+   The keys of all the child positions are collected and sorted first,
+   so that a book file is searched in one sweep.  */
+static int
+probe_positions(Board *board, MoveLst *move_list, const AvlNode *book)
+{
+	int i;
+	int nprobes;
+	int tot_score;
+	BookProbe probes[MAX_NMOVES];
+
+	ASSERT(1, board != NULL);
+	ASSERT(1, move_list != NULL);
+
+	nprobes = 0;
+	for (i = 0; i < move_list->nmoves; i++) {
+		make_move(board, move_list->move[i]);
+		if (get_nrepeats(board, 1) == 0) {
+			probes[nprobes].key = board->posp->key;
+			probes[nprobes].index = i;
+			nprobes++;
+		}
+		undo_move(board);
+	}
+	qsort(probes, nprobes, sizeof(BookProbe), compare_probes);
+
+	if (settings.book_type == BOOK_MAP)
+		find_map_positions(probes, nprobes);
+	else if (book == NULL)
+		find_disk_positions(probes, nprobes);
+	else {
+		for (i = 0; i < nprobes; i++)
+			probes[i].score = find_ram_pos(probes[i].key, book);
+	}
+
+	tot_score = 0;
+	for (i = 0; i < nprobes; i++) {
+		move_list->score[probes[i].index] = probes[i].score;
+		if (probes[i].score != VAL_NONE)
+			tot_score += probes[i].score;
+	}
+	
+	return tot_score;
+}
+
+/* Get the scores of the book moves in <move_list> from a version 2 book,
+   where all the moves of the position are found with one lookup.
+   The weights of the moves are their scores.
+   Returns the combined score of all the moves.  */
+static int
+probe_moves(Board *board, MoveLst *move_list, const AvlNode *book)
+{
+	int i;
+	int j;
+	int nmoves;
+	int tot_score = 0;
+	U64 key = board->posp->key;
+	BookEntry moves[MAX_NMOVES];
+
+	ASSERT(1, board != NULL);
+	ASSERT(1, move_list != NULL);
+
+	if (settings.book_type == BOOK_MAP)
+		nmoves = find_moves(book_map.data, book_map.npos, key, moves);
+	else if (book == NULL)
+		nmoves = find_disk_moves(key, moves);
+	else {
+		/* The tree doesn't have the weights.  */
+		nmoves = 0;
+		for (i = 0; i < move_list->nmoves; i++) {
+			U16 move = PACK_MOVE(move_list->move[i]);
+			const AvlNode *node = find_avl(book, key, move);
+			if (node != NULL)
+				moves[nmoves++] = node->entry;
+		}
+		set_weights(moves, nmoves);
+	}
+
+	/* Only the legal moves that don't repeat a position are accepted.  */
+	for (i = 0; i < nmoves; i++) {
+		for (j = 0; j < move_list->nmoves; j++) {
+			U32 move = move_list->move[j];
+
+			if (PACK_MOVE(move) != moves[i].move)
+				continue;
+			make_move(board, move);
+			if (get_nrepeats(board, 1) == 0) {
+				move_list->score[j] = moves[i].weight;
+				tot_score += moves[i].weight;
+			}
+			undo_move(board);
+			break;
+		}
+	}
+
+	return tot_score;
+}
+
 /* Get a list of available book moves.
    The book can be a tree (AvlNode *book), or a file if <book> is NULL.
+   In the BOOK_MAP mode the mapped book file is used.
    Returns the combined score of all the moves if successfull.  */
 static int
 get_book_move_list(Board *board, MoveLst *move_list, const AvlNode *book)
 {
-	int i, npos, tot_score;
-	FILE *fp = NULL;
+	int i;
+	int version;
 
 	ASSERT(1, board != NULL);
 	ASSERT(1, move_list != NULL);
 
-	npos = 0;
-	tot_score = 0;
-	if (book == NULL) {
-		if ((fp = fopen(settings.book_file, "rb")) == NULL) {
-			my_perror("Can't open file %s", settings.book_file);
+	if (settings.book_type == BOOK_MAP) {
+		if (book_map.data == NULL)
 			return -1;
-		}
-
-		npos = get_pos_count(fp);
-		if (npos <= 0) {
-			fprintf(stderr, "The opening book is empty\n");
+		version = book_map.version;
+	} else if (book == NULL) {
+		if (!book_file.is_open
+		&&  open_disk_book(settings.book_file) != 0)
 			return -1;
-		}
-	}
+		version = book_file.version;
+	} else
+		version = book_version;
 
 	gen_moves(board, move_list);
-	for (i = 0; i < move_list->nmoves; i++) {
-		U32 move = move_list->move[i];
-		int *score = &move_list->score[i];
+	for (i = 0; i < move_list->nmoves; i++)
+		move_list->score[i] = VAL_NONE;
 
-		make_move(board, move);
-		if (get_nrepeats(board, 1) == 0) {
-			U64 key = board->posp->key;
-			if (book == NULL)
-				*score = find_disk_pos(fp, key, npos);
-			else
-				*score = find_ram_pos(key, book);
-		} else
-			*score = VAL_NONE;
-		if (*score != VAL_NONE)
-			tot_score += *score;
-		undo_move(board);
-	}
-	if (book == NULL)
-		my_close(fp, settings.book_file);
-	
-	return tot_score;
+	if (version == 1)
+		return probe_positions(board, move_list, book);
+	return probe_moves(board, move_list, book);
 }
 
 /* Displays a list of the available book moves.  */
@@ -344,85 +1178,502 @@ get_book_move(Board *board, bool show_book, const AvlNode *book)
 	return NULLMOVE;
 }
 
-/* Store a position in an AVL tree.
-   Returns true if the position is new.  */
-bool
-save_book_pos(U64 key, int points, AvlNode **tree)
+/* Add an entry to an AVL tree, or add its counters to an existing entry
+   with the same key and move. The tree isn't marked as modified.
+   Returns true if the entry is new.  */
+static bool
+add_tree_entry(const BookEntry *entry, AvlNode **tree)
 {
-	U16 wins = 0;
 	AvlNode *node;
-	
+
+	if ((node = (AvlNode*)find_avl(*tree, entry->key, entry->move)) != NULL) {
+		node->entry.games += entry->games;
+		node->entry.wins += entry->wins;
+		node->entry.draws += entry->draws;
+		return false;
+	}
+	*tree = (AvlNode*)insert_avl(*tree, entry);
+
+	return true;
+}
+
+/* Add an entry to an AVL tree, or add its counters to an existing entry
+   with the same key and move. Returns true if the entry is new.  */
+bool
+add_book_entry(const BookEntry *entry, AvlNode **tree)
+{
+	ASSERT(1, entry != NULL);
 	ASSERT(1, tree != NULL);
-	ASSERT(1, points == 0 || points == 2);
+	ASSERT(1, entry->wins + entry->draws <= entry->games);
 
 	book_modified = true;
-	if (points == 2)
-		wins = 1;
-	if ((node = (AvlNode*)find_avl(*tree, key)) != NULL) {
-		if (node->games < UINT16_MAX) {
-			(node->games)++;
-			node->wins += wins;
+	return add_tree_entry(entry, tree);
+}
+
+/* Write the output buffer of <bw> to the book file.  */
+static void
+flush_buf(BookWriter *bw)
+{
+	if (bw->buf_len > 0 && fwrite(bw->buf, bw->buf_len, 1, bw->fp) != 1)
+		bw->error = true;
+	bw->buf_len = 0;
+}
+
+/* Write a book entry to the book file of <bw>.  */
+static void
+put_entry(BookWriter *bw, const BookEntry *entry)
+{
+	size_t size = ENTRY_SIZE(bw->version);
+
+	if (bw->buf_len + size > BOOK_WRITE_SIZE)
+		flush_buf(bw);
+	encode_entry(bw->buf + bw->buf_len, bw->version, entry);
+	bw->buf_len += size;
+	bw->count++;
+}
+
+/* Set the weights of the buffered moves of a book writer, and write
+   the moves to the file.  */
+static void
+flush_moves(BookWriter *bw)
+{
+	int i;
+
+	set_weights(bw->moves, bw->nmoves);
+	for (i = 0; i < bw->nmoves; i++)
+		put_entry(bw, &bw->moves[i]);
+	bw->nmoves = 0;
+}
+
+/* Write the header of a version 2 book file with <count> entries.
+   Returns false if the file can't be written.  */
+static bool
+write_header(FILE *fp, U32 count)
+{
+	unsigned char buf[BOOK_HEADER_SIZE];
+
+	memcpy(buf, BOOK_MAGIC, 8);
+	put_u32(buf + 8, BOOK_VERSION);
+	put_u32(buf + 12, count);
+
+	return fwrite(buf, BOOK_HEADER_SIZE, 1, fp) == 1;
+}
+
+/* Create a writer for a book file whose format is <version>. The book is
+   written to a temporary file, which replaces <filename> when the writer
+   is closed. Returns NULL if the file can't be created.  */
+BookWriter *
+open_book_writer(const char *filename, int version)
+{
+	BookWriter *bw;
+
+	ASSERT(1, filename != NULL);
+	ASSERT(1, version == 1 || version == BOOK_VERSION);
+
+	if ((bw = malloc(sizeof(BookWriter))) == NULL)
+		fatal_error("Couldn't allocate memory");
+	strlcpy(bw->filename, filename, MAX_BUF);
+	snprintf(bw->tmp_file, MAX_BUF, "%s.tmp", filename);
+	bw->version = version;
+	bw->count = 0;
+	bw->error = false;
+	bw->nmoves = 0;
+	bw->buf_len = 0;
+
+	if ((bw->fp = fopen(bw->tmp_file, "wb")) == NULL) {
+		my_perror("Can't open file %s", bw->tmp_file);
+		free(bw);
+		return NULL;
+	}
+	/* The header is written again when the count is known.  */
+	if (version > 1 && !write_header(bw->fp, 0))
+		bw->error = true;
+
+	return bw;
+}
+
+/* Write an entry to the end of a book file. The entries must be written
+   in order of the key and the move. Returns false on error.  */
+bool
+write_book_entry(BookWriter *bw, const BookEntry *entry)
+{
+	ASSERT(1, bw != NULL);
+	ASSERT(1, entry != NULL);
+	ASSERT(1, entry->wins + entry->draws <= entry->games);
+
+	if (bw->version == 1)
+		put_entry(bw, entry);
+	else {
+		if (bw->nmoves > 0 && (bw->moves[0].key != entry->key
+		||                     bw->nmoves >= MAX_NMOVES))
+			flush_moves(bw);
+		bw->moves[bw->nmoves++] = *entry;
+	}
+
+	return !bw->error;
+}
+
+/* Finish a book file and replace the old book file with it, and free the
+   writer. If the file couldn't be written, the old book stays intact.
+   Returns true if successfull.  */
+bool
+close_book_writer(BookWriter *bw)
+{
+	bool ok;
+
+	ASSERT(1, bw != NULL);
+
+	if (bw->version > 1)
+		flush_moves(bw);
+	flush_buf(bw);
+	if (bw->version > 1 && (fseek(bw->fp, 0, SEEK_SET) != 0
+	||                      !write_header(bw->fp, bw->count)))
+		bw->error = true;
+	if (fclose(bw->fp) != 0)
+		bw->error = true;
+
+	ok = !bw->error;
+	if (!ok)
+		my_perror("Can't write file %s", bw->tmp_file);
+	else {
+#ifdef WINDOWS
+		remove(bw->filename);
+#endif /* WINDOWS */
+		if (rename(bw->tmp_file, bw->filename) != 0) {
+			my_perror("Can't rename %s to %s",
+			          bw->tmp_file, bw->filename);
+			ok = false;
+		}
+	}
+	if (ok)
+		update_log("Book file saved: %s", bw->filename);
+	else
+		remove(bw->tmp_file);
+	free(bw);
+
+	return ok;
+}
+
+/* Lock the book file <filename> for updating. Other Sloppy processes
+   that update the same book wait until the lock is released with
+   unlock_book(). The lock is on a separate file, <filename>.lock,
+   because the book file itself is replaced when it's updated.
+   Returns false if the lock can't be acquired.  */
+bool
+lock_book(const char *filename)
+{
+	char lock_name[MAX_BUF];
+
+	ASSERT(1, filename != NULL);
+
+	snprintf(lock_name, MAX_BUF, "%s.lock", filename);
+#ifdef WINDOWS
+	{
+		OVERLAPPED ov;
+
+		ASSERT(1, lock_file == INVALID_HANDLE_VALUE);
+		lock_file = CreateFile(lock_name, GENERIC_READ | GENERIC_WRITE,
+			FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL, NULL);
+		if (lock_file == INVALID_HANDLE_VALUE) {
+			my_error("Can't open file %s", lock_name);
+			return false;
+		}
+		memset(&ov, 0, sizeof(ov));
+		if (!LockFileEx(lock_file, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &ov)) {
+			CloseHandle(lock_file);
+			lock_file = INVALID_HANDLE_VALUE;
+			my_error("Can't lock file %s", lock_name);
+			return false;
 		}
-		return false;
 	}
-	*tree = (AvlNode*)insert_avl(*tree, key, 1, wins);
+#else /* not WINDOWS */
+	{
+		struct flock fl;
+
+		ASSERT(1, lock_fd == -1);
+		if ((lock_fd = open(lock_name, O_RDWR | O_CREAT, 0644)) == -1) {
+			my_perror("Can't open file %s", lock_name);
+			return false;
+		}
+		memset(&fl, 0, sizeof(fl));
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		while (fcntl(lock_fd, F_SETLKW, &fl) == -1) {
+			if (errno != EINTR) {
+				my_perror("Can't lock file %s", lock_name);
+				close(lock_fd);
+				lock_fd = -1;
+				return false;
+			}
+		}
+	}
+#endif /* not WINDOWS */
 
 	return true;
 }
 
+/* Release the lock acquired by lock_book().  */
+void
+unlock_book(void)
+{
+#ifdef WINDOWS
+	if (lock_file != INVALID_HANDLE_VALUE) {
+		OVERLAPPED ov;
+
+		memset(&ov, 0, sizeof(ov));
+		UnlockFileEx(lock_file, 0, 1, 0, &ov);
+		CloseHandle(lock_file);
+		lock_file = INVALID_HANDLE_VALUE;
+	}
+#else /* not WINDOWS */
+	/* Closing the file releases the lock.  */
+	if (lock_fd != -1) {
+		close(lock_fd);
+		lock_fd = -1;
+	}
+#endif /* not WINDOWS */
+}
+
+/* Compare two book entries by their keys and moves, for qsort().  */
+static int
+compare_entries(const void *a, const void *b)
+{
+	const BookEntry *entry1 = (const BookEntry*)a;
+	const BookEntry *entry2 = (const BookEntry*)b;
+
+	if (entry1->key != entry2->key)
+		return (entry1->key < entry2->key) ? -1 : 1;
+	if (entry1->move != entry2->move)
+		return (entry1->move < entry2->move) ? -1 : 1;
+	return 0;
+}
+
+/* Append a book learning update to the learning log.  */
+static void
+append_log(const BookEntry *entry)
+{
+	if (learn_log.nentries >= learn_log.size) {
+		BookEntry *tmp;
+		size_t size = (learn_log.size > 0) ? learn_log.size * 2 : 0x400;
+
+		tmp = realloc(learn_log.entries, size * sizeof(BookEntry));
+		if (tmp == NULL)
+			fatal_error("Couldn't allocate memory");
+		learn_log.entries = tmp;
+		learn_log.size = size;
+	}
+	learn_log.entries[learn_log.nentries++] = *entry;
+}
+
+/* Sort the learning log and sum the updates of the same entry.  */
+static void
+reduce_log(void)
+{
+	size_t i;
+	size_t n = 0;
+	BookEntry *entries = learn_log.entries;
+
+	if (learn_log.nentries == 0)
+		return;
+	qsort(entries, learn_log.nentries, sizeof(BookEntry), compare_entries);
+	for (i = 1; i < learn_log.nentries; i++) {
+		if (compare_entries(&entries[i], &entries[n]) == 0) {
+			entries[n].games += entries[i].games;
+			entries[n].wins += entries[i].wins;
+			entries[n].draws += entries[i].draws;
+		} else
+			entries[++n] = entries[i];
+	}
+	learn_log.nentries = n + 1;
+}
+
+/* Merge the sorted learning log with the entries of the book file <fp>,
+   or with an empty book if <fp> is NULL, and write them with <bw>.  */
+static void
+merge_log(FILE *fp, BookWriter *bw)
+{
+	size_t i = 0;
+	bool has_entry;
+	BookEntry entry;
+	const BookEntry *log = learn_log.entries;
+
+	has_entry = (fp != NULL && read_book_entry(fp, bw->version, &entry));
+	while (has_entry || i < learn_log.nentries) {
+		int cmp;
+
+		if (!has_entry)
+			cmp = 1;
+		else if (i >= learn_log.nentries)
+			cmp = -1;
+		else
+			cmp = compare_entries(&entry, &log[i]);
+
+		if (cmp > 0) {
+			write_book_entry(bw, &log[i++]);
+			continue;
+		}
+		if (cmp == 0) {
+			entry.games += log[i].games;
+			entry.wins += log[i].wins;
+			entry.draws += log[i].draws;
+			i++;
+		}
+		write_book_entry(bw, &entry);
+		has_entry = read_book_entry(fp, bw->version, &entry);
+	}
+	if (fp != NULL && ferror(fp))
+		bw->error = true;
+}
+
+/* Write the book learning updates to the book file <filename>.
+   The updates are merged with the current book file while it's locked,
+   so the updates of other Sloppy processes that share the book aren't
+   lost, and the new book replaces the old one atomically. A book in
+   the BOOK_MAP mode is mapped again. Returns 0 if successfull.  */
+int
+flush_learn_log(const char *filename)
+{
+	int ret = -1;
+	FILE *fp = NULL;
+	BookWriter *bw;
+
+	ASSERT(1, filename != NULL);
+
+	if (learn_log.nentries == 0)
+		return 0;
+	if (!lock_book(filename))
+		return -1;
+
+	reduce_log();
+	if (file_exists(filename) && (fp = fopen(filename, "rb")) == NULL)
+		my_perror("Can't open file %s", filename);
+	else if (fp != NULL && read_book_header(fp, NULL) != learn_log.version)
+		my_error("The format of book file %s has changed", filename);
+	else if ((bw = open_book_writer(filename, learn_log.version)) != NULL) {
+		merge_log(fp, bw);
+		/* The old book can't stay open while it's replaced.  */
+		if (fp != NULL) {
+			my_close(fp, filename);
+			fp = NULL;
+		}
+		close_book();
+		if (close_book_writer(bw))
+			ret = 0;
+		if (settings.book_type == BOOK_MAP && map_book(filename) != 0)
+			settings.book_type = BOOK_OFF;
+	}
+	if (fp != NULL)
+		my_close(fp, filename);
+	unlock_book();
+
+	/* If the updates couldn't be written they're dropped, so that
+	   a broken book file doesn't make the log grow forever.  */
+	learn_log.nentries = 0;
+
+	return ret;
+}
+
 /* Write an AVL tree to a file (the opening book), then clear the tree.
+   If the tree wasn't modified by importing PGN files, only the book
+   learning updates are written with flush_learn_log().
    Returns 0 if successfull.  */
 int
 write_book(const char *filename, AvlNode *tree)
 {
-	FILE *fp;
+	bool ok;
+	BookWriter *bw;
 	
 	ASSERT(1, filename != NULL);
 	
+	if (!book_modified)
+		return flush_learn_log(filename);
+
 	if (tree == NULL)
 		return -1;
 
-	if (!book_modified)
-		return 0;
-
-	if ((fp = fopen(filename, "wb")) == NULL) {
-		my_perror("Can't open file %s", filename);
+	if (!lock_book(filename))
+		return -1;
+	if ((bw = open_book_writer(filename, book_version)) == NULL) {
+		unlock_book();
 		return -1;
 	}
+	write_avl(tree, bw);
+	ok = close_book_writer(bw);
+	unlock_book();
 
-	write_avl(tree, fp);
-	
-	my_close(fp, filename);
-	update_log("Book file saved: %s", filename);
+	/* The tree has the book learning updates too.  */
+	learn_log.nentries = 0;
+	if (!ok)
+		return -1;
+	book_modified = false;
 
 	return 0;
 }
 
-/* Store the positions of a played game (stored in <board>) in an AVL tree.
-   <winner> is either WHITE or BLACK.  */
+/* Returns the format version of the book that's in use.  */
+static int
+get_active_version(void)
+{
+	if (settings.book_type == BOOK_MAP && book_map.base != NULL)
+		return book_map.version;
+	if (settings.book_type == BOOK_DISK
+	&&  (book_file.is_open || open_disk_book(settings.book_file) == 0))
+		return book_file.version;
+	return book_version;
+}
+
+/* Store the positions of a played game (stored in <board>) in the
+   learning log, and in the BOOK_MEM mode also in an AVL tree.
+   <winner> is either WHITE or BLACK. In a version 2 book the moves are
+   stored with the positions before them. The log is merged with the
+   book file under the book lock when the game ends, so the result isn't
+   lost if Sloppy is killed before it exits.  */
 void
 book_learn(const Board *board, int winner, AvlNode **tree)
 {
 	int i;
+	int version;
 	
 	ASSERT(1, board != NULL);
 	ASSERT(1, tree != NULL);
 
 	if (!settings.use_learning)
 		return;
-	if (*tree == NULL)
+	if (settings.book_type == BOOK_MEM && *tree == NULL)
 		printf("Creating a new opening book...\n");
 	
+	/* The updates of an earlier game are left in the log if the book
+	   couldn't be locked. The book may also have been replaced with a
+	   book of another format.  */
+	version = get_active_version();
+	if (learn_log.nentries > 0 && learn_log.version != version)
+		flush_learn_log(settings.book_file);
+	if (learn_log.nentries == 0)
+		learn_log.version = version;
+
 	for (i = 1; i < board->nmoves; i++) {
-		int points;
+		BookEntry entry;
 		
 		if (board->pos[i].key == 0 || i > 26)
 			continue;
-		if (!(i % 2) == winner)
-			points = 2;
-		else
-			points = 0;
-		(void)save_book_pos(board->pos[i].key, points, tree);
+		if (version == 1) {
+			entry.key = board->pos[i].key;
+			entry.move = 0;
+		} else {
+			entry.key = board->pos[i - 1].key;
+			entry.move = PACK_MOVE(board->pos[i].move);
+		}
+		entry.weight = 0;
+		entry.games = 1;
+		/* White makes the odd moves of the game.  */
+		entry.wins = (winner == ((i % 2) ? WHITE : BLACK));
+		entry.draws = 0;
+		if (settings.book_type == BOOK_MEM)
+			(void)add_tree_entry(&entry, tree);
+		append_log(&entry);
 	}
+
+	flush_learn_log(settings.book_file);
 }
 
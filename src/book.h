@@ -3,7 +3,25 @@
 
 #include "sloppy.h"
 
+/* The format version of new book files.  */
+#define BOOK_VERSION 2
+
+/* A book entry. In a version 2 book the entry is a move of a position,
+   and <key> is the key of the position before the move. In a version 1
+   book the entry is a position, <key> is its key, and <move>, <weight>
+   and <draws> are 0.  */
+typedef struct _BookEntry
+{
+	U64 key;	/* hash key */
+	U16 move;	/* the move, see PACK_MOVE() */
+	U16 weight;	/* score of the move, the best move of a pos has 65535 */
+	U32 games;	/* num. of games where the move was played */
+	U32 wins;	/* num. of those games won by the side that moved */
+	U32 draws;	/* num. of those games that were drawn */
+} BookEntry;
+
 struct _AvlNode;
+struct _BookWriter;
 
 
 /* Returns true if <filename> exists.  */
@@ -13,6 +31,14 @@ extern bool file_exists(const char *filename);
    Returns 0 if successfull.  */
 extern int book_to_tree(const char *filename, struct _AvlNode **tree);
 
+/* Map an opening book file to memory for the BOOK_MAP book mode.
+   Returns 0 if successfull.  */
+extern int map_book(const char *filename);
+
+/* Close the book file that's used by the BOOK_MAP or BOOK_DISK book
+   mode, if any.  */
+extern void close_book(void);
+
 /* Displays a list of the available book moves.  */
 extern void print_book(Board *board, const struct _AvlNode *book);
 
@@ -21,16 +47,60 @@ extern void print_book(Board *board, const struct _AvlNode *book);
    If <show_book> is true, a list of available moves is displayed.  */
 extern U32 get_book_move(Board *board, bool show_book, const struct _AvlNode *book);
 
-/* Store a position in an AVL tree.
-   Returns true if the position is new.  */
-extern bool save_book_pos(U64 key, int points, struct _AvlNode **tree);
+/* Returns the format version of the book in the AVL tree.  */
+extern int get_book_version(void);
+
+/* Add an entry to an AVL tree, or add its counters to an existing entry
+   with the same key and move. Returns true if the entry is new.  */
+extern bool add_book_entry(const BookEntry *entry, struct _AvlNode **tree);
+
+/* Read the header of a book file, and leave <fp> at the first entry.
+   Returns the format version of the book, or -1 if the header is invalid.
+   If <npos> isn't NULL, the number of entries is stored in it.  */
+extern int read_book_header(FILE *fp, size_t *npos);
+
+/* Read the next entry from a book file whose format is <version>.
+   Returns false at the end of the file, or if the file can't be read.  */
+extern bool read_book_entry(FILE *fp, int version, BookEntry *entry);
+
+/* Create a writer for a book file whose format is <version>. The book is
+   written to a temporary file, which replaces <filename> when the writer
+   is closed. Returns NULL if the file can't be created.  */
+extern struct _BookWriter *open_book_writer(const char *filename, int version);
+
+/* Write an entry to the end of a book file. The entries must be written
+   in order of the key and the move. Returns false on error.  */
+extern bool write_book_entry(struct _BookWriter *bw, const BookEntry *entry);
+
+/* Finish a book file and replace the old book file with it, and free the
+   writer. If the file couldn't be written, the old book stays intact.
+   Returns true if successfull.  */
+extern bool close_book_writer(struct _BookWriter *bw);
+
+/* Lock the book file <filename> for updating. Other Sloppy processes
+   that update the same book wait until the lock is released with
+   unlock_book(). Returns false if the lock can't be acquired.  */
+extern bool lock_book(const char *filename);
+
+/* Release the lock acquired by lock_book().  */
+extern void unlock_book(void);
+
+/* Write the book learning updates to the book file <filename>.
+   The updates are merged with the current book file while it's locked,
+   and the new book replaces the old one atomically.
+   Returns 0 if successfull.  */
+extern int flush_learn_log(const char *filename);
 
 /* Write an AVL tree to a file (the opening book), then clear the tree.
+   If the tree wasn't modified by importing PGN files, only the book
+   learning updates are written with flush_learn_log().
    Returns 0 if successfull.  */
 extern int write_book(const char *filename, struct _AvlNode *tree);
 
-/* Store the positions of a played game (stored in <board>) in an AVL tree.
-   <winner> is either WHITE or BLACK.  */
+/* Store the positions of a played game (stored in <board>) in the
+   learning log, and in the BOOK_MEM mode also in an AVL tree.
+   <winner> is either WHITE or BLACK. The log is merged with the book
+   file under the book lock when the game ends.  */
 extern void book_learn(const Board *board, int winner, struct _AvlNode **tree);
 
 #endif /* BOOK_H */
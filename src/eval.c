@@ -31,7 +31,7 @@
 #include "sloppy.h"
 #include "debug.h"
 #include "util.h"
-#include "magicmoves.h"
+#include "attacks.h"
 #include "movegen.h"
 #include "eval.h"
 
@@ -80,10 +80,15 @@
 #define WHITE_SQUARES 0xaa55aa55aa55aa55
 #define BLACK_SQUARES 0x55aa55aa55aa55aa
 
+/* Evaluation data for one position. The attack maps are generated only
+   once per eval() call, and they're shared by the mobility, king attack
+   and passed pawn evaluation.  */
 typedef struct _EvalData
 {
 	int op;
 	int eg;
+	U64 pc_atk[64];		/* squares attacked by the piece in each square */
+	U64 atk[2][KING + 1];	/* squares attacked by each piece type */
 } EvalData;
 
 /* If we're not using GNU C, elide __attribute__  */
@@ -92,6 +97,7 @@ typedef struct _EvalData
   //#   pragma pack(1)
 #endif /* not __GNUC__ */
 
+/* The default size of the pawn hash table (num. of entries).  */
 #define PHASH_SIZE 0x8000
 typedef struct _PawnHash
 {
@@ -102,6 +108,8 @@ typedef struct _PawnHash
 } __attribute__ ((__packed__)) PawnHash;
 
 static PawnHash *pawn_hash = NULL;
+/* The number of entries in the pawn hash table, a power of 2.  */
+static size_t phash_size = PHASH_SIZE;
 
 const int pc_val[] = { 0, VAL_PAWN, VAL_KNIGHT, VAL_BISHOP,
                        VAL_ROOK, VAL_QUEEN, VAL_KING, 0 };
@@ -404,15 +412,16 @@ init_ka_masks(void)
 	}
 }
 
-static void
-init_pawn_hash(void)
+/* Clear the pawn hash table.  */
+void
+clear_pawn_hash(void)
 {
-	int i;
+	size_t i;
 	PawnHash *hash;
 	
-	pawn_hash = calloc(PHASH_SIZE, sizeof(PawnHash));
-	
-	for (i = 0; i < PHASH_SIZE; i++) {
+	ASSERT(1, pawn_hash != NULL);
+
+	for (i = 0; i < phash_size; i++) {
 		hash = &pawn_hash[i];
 		hash->passers = 0;
 		hash->key = 1;
@@ -421,6 +430,56 @@ init_pawn_hash(void)
 	}
 }
 
+static void
+init_pawn_hash(void)
+{
+	pawn_hash = calloc(phash_size, sizeof(PawnHash));
+	if (pawn_hash == NULL)
+		fatal_perror("Can't allocate memory for the pawn hash table");
+	clear_pawn_hash();
+}
+
+/* Change the pawn hash table size to <hsize> megabytes and clear the
+   table. The number of entries is rounded down to a power of 2.
+   If the memory can't be allocated, the old table is kept and false
+   is returned.  */
+bool
+resize_pawn_hash(int hsize)
+{
+	size_t nentries;
+	size_t max_entries;
+	PawnHash *tmp;
+
+	ASSERT(1, hsize > 0);
+
+	max_entries = ((size_t)hsize * 0x100000) / sizeof(PawnHash);
+	for (nentries = 1; nentries * 2 <= max_entries; nentries *= 2)
+		;
+	if (pawn_hash != NULL && nentries == phash_size) {
+		clear_pawn_hash();
+		return true;
+	}
+
+	tmp = calloc(nentries, sizeof(PawnHash));
+	if (tmp == NULL) {
+		my_perror("Can't allocate %d MB for the pawn hash table", hsize);
+		return false;
+	}
+	destroy_pawn_hash();
+	pawn_hash = tmp;
+	phash_size = nentries;
+	clear_pawn_hash();
+
+	return true;
+}
+
+/* Returns the size of the pawn hash table in bytes.  */
+size_t
+get_pawn_hash_size(void)
+{
+	return phash_size * sizeof(PawnHash);
+}
+
 void
 destroy_pawn_hash(void)
 {
@@ -635,8 +694,8 @@ see(const Board *board, U32 move, int color)
 		(move_masks.pawn_capt[WHITE][to] & blacks[PAWN]) |
 		(move_masks.pawn_capt[BLACK][to] & whites[PAWN]) |
 		(move_masks.knight[to] & (whites[KNIGHT] | blacks[KNIGHT])) |
-		(B_MAGIC(to, mask) & bq) |
-		(R_MAGIC(to, mask) & rq) |
+		(B_ATTACKS(to, mask) & bq) |
+		(R_ATTACKS(to, mask) & rq) |
 		(move_masks.king[to] & (whites[KING] | blacks[KING]));
 
 	if (capt)
@@ -656,8 +715,8 @@ see(const Board *board, U32 move, int color)
 
 	/* If the moving piece is a slider, the move may have given way for
 	   other sliders to attack <to>. So we update <attacks>.  */
-	attacks |= (B_MAGIC(to, mask) & mask) & bq;
-	attacks |= (R_MAGIC(to, mask) & mask) & rq;
+	attacks |= (B_ATTACKS(to, mask) & mask) & bq;
+	attacks |= (R_ATTACKS(to, mask) & mask) & rq;
 
 	while (attacks) {
 		/* No captures available, end of exchange.  */
@@ -697,8 +756,8 @@ see(const Board *board, U32 move, int color)
 
 		/* Update <attacks> in case there are new pieces capable of
 		   attacking <to>.  */
-		attacks |= (B_MAGIC(to, mask) & mask) & bq;
-		attacks |= (R_MAGIC(to, mask) & mask) & rq;
+		attacks |= (B_ATTACKS(to, mask) & mask) & bq;
+		attacks |= (R_ATTACKS(to, mask) & mask) & rq;
 
 		color = !color;
 	}
@@ -810,7 +869,7 @@ king_passer(const Board *board, int color, int pawn_sq)
 
 /* Returns true if the pawn can advance safely.  */
 static bool
-free_passer(const Board *board, int color, int from)
+free_passer(const Board *board, int color, int from, const EvalData *ed)
 {
 
 	int to;
@@ -824,6 +883,11 @@ free_passer(const Board *board, int color, int from)
 
 	if (board->mailbox[to] != 0)
 		return false;
+	/* If the opponent doesn't attack <to>, not even with an x-ray
+	   attack through <from>, there's no need for SEE.  */
+	if (!(ed->atk[!color][ALL] & bit64[to])
+	&&  !(board->pcs[!color][RQ] & fwd_mask[!color][from]))
+		return true;
 
 	if (bit64[from] & seventh_rank[color])
 		prom = QUEEN;
@@ -867,7 +931,7 @@ passer_eval(const Board *board, int color, int sq, EvalData *ed)
 	&& (unstoppable_passer(board, color, sq) ||
 	    king_passer(board, color, sq)))
 		delta += 800;
-	else if (free_passer(board, color, sq))
+	else if (free_passer(board, color, sq, ed))
 		delta += 60;
 
 	/* King-distance bonus.  */
@@ -1128,7 +1192,7 @@ bishop_eval(const Board *board, int color, int sq, EvalData *ed)
 	LOG_EG(color, LOG_POSITION, pcsq_bishop_eg[sq]);
 	
 	/* Mobility.  */
-	mask = B_MAGIC(sq, board->all_pcs);
+	mask = ed->pc_atk[sq];
 	mob = popcount(mask & ~board->pcs[color][ALL]);
 	*op += (mob - 6) * 5;
 	LOG_OP(color, LOG_MOBILITY, (mob - 6) * 5);
@@ -1258,7 +1322,7 @@ rook_eval(const Board *board, int color, int sq, EvalData *ed)
 	}
 	
 	/* Mobility.  */
-	mask = R_MAGIC(sq, board->all_pcs);
+	mask = ed->pc_atk[sq];
 	mob = popcount(mask & ~board->pcs[color][ALL]);
 	*op += (mob - 7) * 2;
 	LOG_OP(color, LOG_MOBILITY, (mob - 7) * 2);
@@ -1396,73 +1460,113 @@ king_eval(const Board *board, int color, int sq, EvalData *ed)
 	LOG_EG(color, LOG_POSITION, pcsq_king_eg[sq]);
 }
 
-/* Get a mask of all attacks (no castling, pawn pushes, or king moves)
-   by <color>, and assign the combined value of king attacks to <sum>.  */
 #define FWD_LEFT(mask, color) ((color) == WHITE ? (mask) >> 9 : (mask) << 7)
 #define FWD_RIGHT(mask, color) ((color) == WHITE ? (mask) >> 7 : (mask) << 9)
-static U64
-get_attack_mask(const Board *board, int color, int *sum)
+
+/* Add the attacks of one piece type to <ed>'s attack maps.  */
+static void
+add_attacks(EvalData *ed, int color, int pc, U64 attacks)
+{
+	ed->atk[color][pc] |= attacks;
+	ed->atk[color][ALL] |= attacks;
+}
+
+/* Generate the attack maps of both sides (no castling or pawn pushes).  */
+static void
+init_attack_maps(const Board *board, EvalData *ed)
 {
-	int sq;		/* attacked square */
+	int sq;
+	int pc;
+	int color;
+	U64 mask;
+	U64 left;
+	U64 right;
+
+	ASSERT(2, board != NULL);
+	ASSERT(2, ed != NULL);
+
+	for (color = WHITE; color <= BLACK; color++) {
+		const U64 *my_pcs = &board->pcs[color][ALL];
+
+		for (pc = ALL; pc <= KING; pc++)
+			ed->atk[color][pc] = 0;
+
+		/* Pawn attacks.  */
+		left = FWD_LEFT(my_pcs[PAWN], color) & FILE_A_G;
+		right = FWD_RIGHT(my_pcs[PAWN], color) & FILE_B_H;
+		ed->atk[color][PAWN] = left | right;
+		ed->atk[color][ALL] = left | right;
+
+		mask = my_pcs[KNIGHT];
+		while (mask) {
+			sq = pop_lsb(&mask);
+			ed->pc_atk[sq] = move_masks.knight[sq];
+			add_attacks(ed, color, KNIGHT, ed->pc_atk[sq]);
+		}
+		mask = my_pcs[BISHOP];
+		while (mask) {
+			sq = pop_lsb(&mask);
+			ed->pc_atk[sq] = B_ATTACKS(sq, board->all_pcs);
+			add_attacks(ed, color, BISHOP, ed->pc_atk[sq]);
+		}
+		mask = my_pcs[ROOK];
+		while (mask) {
+			sq = pop_lsb(&mask);
+			ed->pc_atk[sq] = R_ATTACKS(sq, board->all_pcs);
+			add_attacks(ed, color, ROOK, ed->pc_atk[sq]);
+		}
+		mask = my_pcs[QUEEN];
+		while (mask) {
+			sq = pop_lsb(&mask);
+			ed->pc_atk[sq] = Q_ATTACKS(sq, board->all_pcs);
+			add_attacks(ed, color, QUEEN, ed->pc_atk[sq]);
+		}
+		sq = board->king_sq[color];
+		ed->pc_atk[sq] = move_masks.king[sq];
+		add_attacks(ed, color, KING, ed->pc_atk[sq]);
+	}
+}
+
+/* Returns the combined value of <color>'s pieces that attack the
+   opponent's king zone.  */
+static int
+get_king_attack_sum(const Board *board, int color, const EvalData *ed)
+{
+	int sum = 0;
 	U64 mask;	/* attacking pieces of one piece type */
-	U64 attacks;	/* all attacked squares */
-	U64 tmp;	/* squares attacked by one piece */
 	U64 ka;		/* king-attack mask */
 	const U64 *my_pcs;
 	
 	ASSERT(2, board != NULL);
-	ASSERT(2, sum != NULL);
+	ASSERT(2, ed != NULL);
 
-	*sum = 0;
 	ka = ka_mask[board->king_sq[!color]];
 	my_pcs = &board->pcs[color][ALL];
 
-	/* Pawn attacks.  */
-	attacks = (FWD_LEFT(board->pcs[color][PAWN], color) & FILE_A_G) |
-	          (FWD_RIGHT(board->pcs[color][PAWN], color) & FILE_B_H);
-
-
-	/* Knight attacks.  */
+	/* Knights only count if they attack the king's neighborhood.  */
 	mask = my_pcs[KNIGHT];
 	while (mask) {
-		sq = pop_lsb(&mask);
-		tmp = move_masks.knight[sq];
-		if ((tmp & move_masks.king[board->king_sq[!color]]) != 0)
-			*sum += 3;
-		attacks |= tmp;
+		if (ed->pc_atk[pop_lsb(&mask)]
+		&   move_masks.king[board->king_sq[!color]])
+			sum += 3;
 	}
-
-	/* Bishop attacks.  */
 	mask = my_pcs[BISHOP];
 	while (mask) {
-		sq = pop_lsb(&mask);
-		tmp = B_MAGIC(sq, board->all_pcs);
-		if (tmp & ka)
-			*sum += 3;
-		attacks |= tmp;
+		if (ed->pc_atk[pop_lsb(&mask)] & ka)
+			sum += 3;
 	}
-
-	/* Rook attacks.  */
 	mask = my_pcs[ROOK];
 	while (mask) {
-		sq = pop_lsb(&mask);
-		tmp = R_MAGIC(sq, board->all_pcs);
-		if (tmp & ka)
-			*sum += 6;
-		attacks |= tmp;
+		if (ed->pc_atk[pop_lsb(&mask)] & ka)
+			sum += 6;
 	}
-	
-	/* Queen attacks */
 	mask = my_pcs[QUEEN];
 	while (mask) {
-		sq = pop_lsb(&mask);
-		tmp = Q_MAGIC(sq, board->all_pcs);
-		if (tmp & ka)
-			*sum += 12;
-		attacks |= tmp;
+		if (ed->pc_atk[pop_lsb(&mask)] & ka)
+			sum += 12;
 	}
 	
-	return attacks;
+	return sum;
 }
 
 /* Evaluate attacks and threats against the kings.  */
@@ -1470,50 +1574,48 @@ static void
 king_attack_eval(const Board *board, EvalData *ed)
 {
 	int color;
-	int sum[2];
-	bool do_ka[2] = { false, false };
-	U64 attacks[2];
 	
 	ASSERT(1, board != NULL);
 
-	if (board->material[WHITE] > VAL_QUEEN && board->pcs[WHITE][QUEEN])
-		do_ka[WHITE] = true;
-	if (board->material[BLACK] > VAL_QUEEN && board->pcs[BLACK][QUEEN])
-		do_ka[BLACK] = true;
-	if (!do_ka[WHITE] && !do_ka[BLACK])
-		return;
-	
-	attacks[WHITE] = get_attack_mask(board, WHITE, &sum[WHITE]);
-	attacks[BLACK] = get_attack_mask(board, BLACK, &sum[BLACK]);
-	
 	for (color = WHITE; color <= BLACK; color++) {
-		int king_sq = board->king_sq[color];
 		int op_king_sq = board->king_sq[!color];
 		int counter = 0;
+		int sum;
 		int score;
 		U64 mask;
-		U64 atk;
+		U64 def;
 
-		if (!do_ka[color])
+		if (board->material[color] <= VAL_QUEEN
+		||  !board->pcs[color][QUEEN])
 			continue;
-		/* The attacked squares. The king can join in an attack,
-		   but it can't be a defending piece.  */
-		atk = attacks[color] | move_masks.king[king_sq];
+		/* The king can join in an attack, but it can't be
+		   a defending piece.  */
+		def = ed->atk[!color][PAWN] | ed->atk[!color][KNIGHT] |
+		      ed->atk[!color][BISHOP] | ed->atk[!color][ROOK] |
+		      ed->atk[!color][QUEEN];
 		
 		/* Squares attacked by <color>.  */
-		mask = ka_mask[op_king_sq] & atk;
+		mask = ka_mask[op_king_sq] & ed->atk[color][ALL];
 		counter += popcount(mask);
 		/* Attacked squares undefended by <!color>.  */
-		mask &= ~attacks[!color];
+		mask &= ~def;
 		counter += popcount(mask);
 		
-		score = sum[color] + (sum[color] * counter) / 12;
+		sum = get_king_attack_sum(board, color, ed);
+		score = sum + (sum * counter) / 12;
 		score = (score * score) / 11;
 		ed->op += SIGN(color) * score;
 		LOG_OP(color, LOG_KING_ATTACK, score);
 	}
 }
 
+/* Prefetch the pawn hash table entry of <pawn_key> into the cache.  */
+void
+prefetch_pawn_hash(U64 pawn_key)
+{
+	PREFETCH(&pawn_hash[pawn_key & (phash_size - 1)]);
+}
+
 static bool
 probe_pawn_hash(U64 key, U64 *passers, EvalData *ed)
 {
@@ -1524,7 +1626,7 @@ probe_pawn_hash(U64 key, U64 *passers, EvalData *ed)
 
 	if (key == 1)
 		return false;
-	hash = &pawn_hash[key & (PHASH_SIZE - 1)];
+	hash = &pawn_hash[key & (phash_size - 1)];
 	if (hash->key == key) {
 		*passers = hash->passers;
 		ed->op += hash->op;
@@ -1540,7 +1642,7 @@ store_pawn_hash(U64 key, U64 passers, int op, int eg)
 {
 	PawnHash *hash;
 	
-	hash = &pawn_hash[key & (PHASH_SIZE - 1)];
+	hash = &pawn_hash[key & (phash_size - 1)];
 	if (hash->key != key) {
 		hash->key = key;
 		hash->passers = passers;
@@ -1644,6 +1746,7 @@ eval(const Board *board)
 	ASSERT(2, board != NULL);
 	ASSERT(2, !board_is_check(board));
 	init_ed(&ed);
+	init_attack_maps(board, &ed);
 	init_eval_log();
 
 	for (color = WHITE; color <= BLACK; color++) {
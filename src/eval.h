@@ -20,6 +20,21 @@ extern const int phase_val[];	/* piece values for determining the phase */
 /* Deallocate resources used by the pawn hash table.  */
 extern void destroy_pawn_hash(void);
 
+/* Clear the pawn hash table.  */
+extern void clear_pawn_hash(void);
+
+/* Change the pawn hash table size to <hsize> megabytes and clear the
+   table. The number of entries is rounded down to a power of 2.
+   If the memory can't be allocated, the old table is kept and false
+   is returned.  */
+extern bool resize_pawn_hash(int hsize);
+
+/* Returns the size of the pawn hash table in bytes.  */
+extern size_t get_pawn_hash_size(void);
+
+/* Prefetch the pawn hash table entry of <pawn_key> into the cache.  */
+extern void prefetch_pawn_hash(U64 pawn_key);
+
 /* Initialize evaluation bitmasks.  */
 extern void init_eval(void);
 
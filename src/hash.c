@@ -29,9 +29,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "sloppy.h"
 #include "debug.h"
 #include "util.h"
+#include "movegen.h"
+#include "thread.h"
 #include "hash.h"
 
 
@@ -39,12 +42,25 @@
    less likely to be replaced by other nodes.  */
 #define PV_PRIORITY 3
 
+/* The search generation is stored in 6 bits.  */
+#define GEN_MASK 077
+
+/* Macros for accessing the compact hash entries.  */
+#define HASH_KEY(key)	((U32)((key) >> 32))
+#define GET_HFLAG(h)	((h)->age_flag & 03)
+#define GET_HGEN(h)	((h)->age_flag >> 2)
+#define SET_AGE_FLAG(gen, flag) ((U8)((((gen) & GEN_MASK) << 2) | (flag)))
+
 /* Random values for everything that's needed in a hash key (side to move,
    enpassant square, castling rights, and piece positions).  */
 Zobrist zobrist;
 
-/* Sloppy's main hash table.  */
-static Hash *hash_table = NULL;
+/* Sloppy's main hash table, aligned to the cache line size.  */
+static HashBucket *hash_table = NULL;
+/* The allocated memory block of the hash table.  */
+static void *hash_mem = NULL;
+/* The current search generation.  */
+static int hash_gen = 0;
 
 /* Returns a pseudo-random unsigned 64-bit number.  */
 static U64
@@ -57,21 +73,111 @@ rand64(void)
 	return rand1 ^ (rand2 << 31) ^ (rand3 << 62);
 }
 
-/* Clear the whole hash table.  */
+#ifdef USE_THREADS
+
+/* Tables smaller than this (in buckets) are cleared in one thread.  */
+#define MIN_PARALLEL_CLEAR 0x100000
+
+/* A part of the hash table that's cleared by one thread.  */
+typedef struct _ClearJob
+{
+	HashBucket *start;
+	size_t nbuckets;
+} ClearJob;
+
+/* The starting point for the threads that clear the hash table.  */
+static tfunc_t
+clear_threadfunc(void *data)
+{
+	ClearJob *job = (ClearJob*)data;
+	ASSERT(2, job != NULL);
+
+	memset(job->start, 0, job->nbuckets * sizeof(HashBucket));
+
+	return 0;
+}
+
+/* Clear the hash table in <nthreads> parallel parts. If a thread can't
+   be created, its part and the parts after it are cleared by the calling
+   thread. Returns false if the thread data can't be allocated.  */
+static bool
+clear_hash_parallel(int nthreads)
+{
+	int i;
+	size_t chunk;
+	thread_t *threads;
+	ClearJob *jobs;
+
+	threads = calloc(nthreads, sizeof(thread_t));
+	jobs = calloc(nthreads, sizeof(ClearJob));
+	if (threads == NULL || jobs == NULL) {
+		free(threads);
+		free(jobs);
+		return false;
+	}
+
+	chunk = settings.hash_size / nthreads;
+	for (i = 0; i < nthreads; i++) {
+		jobs[i].start = hash_table + i * chunk;
+		if (i < nthreads - 1)
+			jobs[i].nbuckets = chunk;
+		else
+			jobs[i].nbuckets = settings.hash_size - i * chunk;
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (t_create(clear_threadfunc, (void*)&jobs[i], &threads[i]) != 0)
+			break;
+	}
+	if (i > 0)
+		join_threads(threads, i);
+	for (; i < nthreads; i++)
+		clear_threadfunc((void*)&jobs[i]);
+
+	free(threads);
+	free(jobs);
+	return true;
+}
+
+#endif /* USE_THREADS */
+
+/* Clear the whole hash table. An empty entry is all zeros, so the
+   table can be cleared with memset(), and a big table is cleared
+   by settings.nthreads threads.  */
 static void
 clear_hash_table(void)
+{
+	ASSERT(1, H_NONE == 0);
+	ASSERT(1, NULLMOVE == 0);
+
+	hash_gen = 0;
+#ifdef USE_THREADS
+	if (settings.nthreads > 1 && settings.hash_size >= MIN_PARALLEL_CLEAR
+	&&  clear_hash_parallel(settings.nthreads))
+		return;
+#endif /* USE_THREADS */
+	memset(hash_table, 0, settings.hash_size * sizeof(HashBucket));
+}
+
+/* Returns the hash table bucket of <key>.  */
+static HashBucket *
+get_bucket(U64 key)
+{
+	return &hash_table[key % settings.hash_size];
+}
+
+/* Returns the entry of <key> in <bucket>, or NULL if it's not there.  */
+static Hash *
+find_entry(HashBucket *bucket, U64 key)
 {
 	int i;
-	Hash *hash;
-	for (i = 0; i < settings.hash_size; i++) {
-		hash = &hash_table[i];
-		hash->key = 0;
-		hash->val = 0;
-		hash->flag = H_NONE;
-		hash->best = NULLMOVE;
-		hash->depth = 0;
-		hash->priority = 0;
+	U32 hkey = HASH_KEY(key);
+
+	for (i = 0; i < HASH_BUCKET_SIZE; i++) {
+		Hash *hash = &bucket->entry[i];
+		if (hash->key == hkey && GET_HFLAG(hash) != H_NONE)
+			return hash;
 	}
+	return NULL;
 }
 
 /* Set a new hash table size (in megabytes),
@@ -81,11 +187,8 @@ set_hash_size(int hsize)
 {
 	ASSERT(1, hsize > 0);
 	
-	if (hash_table != NULL) {
-		free(hash_table);
-		hash_table = NULL;
-	}
-	settings.hash_size = (hsize * 0x100000) / sizeof(Hash);
+	destroy_hash();
+	settings.hash_size = ((size_t)hsize * 0x100000) / sizeof(HashBucket);
 }
 
 /* Initialize the hash table.  */
@@ -93,11 +196,126 @@ void
 init_hash(void)
 {
 	ASSERT(1, settings.hash_size > 0);
+	ASSERT(1, sizeof(HashBucket) == 32);
 	
-	hash_table = calloc(settings.hash_size, sizeof(Hash));
+	hash_mem = malloc(settings.hash_size * sizeof(HashBucket) + 63);
+	if (hash_mem == NULL)
+		fatal_perror("Can't allocate memory for the hash table");
+	hash_table = (HashBucket *)(((size_t)hash_mem + 63) & ~(size_t)63);
 	clear_hash_table();
 }
 
+/* Prefetch the hash table bucket of <key> into the cache.  */
+void
+prefetch_hash(U64 key)
+{
+	PREFETCH(get_bucket(key));
+}
+
+/* The number of buckets sampled by get_hash_stats().  */
+#define HASH_SAMPLE_SIZE 1000
+
+/* Sample the hash table usage into <stats>.  */
+void
+get_hash_stats(HashStats *stats)
+{
+	size_t i;
+	size_t nbuckets;
+	int j;
+	int nentries;
+	int prev_gen;
+	int counts[3] = { 0, 0, 0 };
+
+	ASSERT(1, stats != NULL);
+
+	nbuckets = settings.hash_size;
+	if (nbuckets > HASH_SAMPLE_SIZE)
+		nbuckets = HASH_SAMPLE_SIZE;
+	prev_gen = (hash_gen - 1) & GEN_MASK;
+	for (i = 0; i < nbuckets; i++) {
+		for (j = 0; j < HASH_BUCKET_SIZE; j++) {
+			const Hash *hash = &hash_table[i].entry[j];
+			if (GET_HFLAG(hash) == H_NONE)
+				continue;
+			if (GET_HGEN(hash) == hash_gen)
+				counts[0]++;
+			else if (GET_HGEN(hash) == prev_gen)
+				counts[1]++;
+			else
+				counts[2]++;
+		}
+	}
+
+	nentries = (int)nbuckets * HASH_BUCKET_SIZE;
+	stats->current = (counts[0] * 1000) / nentries;
+	stats->previous = (counts[1] * 1000) / nentries;
+	stats->older = (counts[2] * 1000) / nentries;
+	stats->full = ((counts[0] + counts[1] + counts[2]) * 1000) / nentries;
+}
+
+/* Print the hash table size and a sample of its usage.  */
+void
+print_hash_stats(void)
+{
+	HashStats stats;
+
+	get_hash_stats(&stats);
+	printf("Hash table size: %lu MB (%lu buckets of %d entries)\n",
+	       (unsigned long)((sizeof(HashBucket) * settings.hash_size) / 0x100000),
+	       (unsigned long)settings.hash_size, HASH_BUCKET_SIZE);
+	printf("Hash table usage: %.1f%% (current search %.1f%%, "
+	       "previous search %.1f%%, older %.1f%%)\n",
+	       stats.full / 10.0, stats.current / 10.0,
+	       stats.previous / 10.0, stats.older / 10.0);
+}
+
+/* Change the hash table size to <hsize> megabytes and clear the table,
+   without stopping the program. If the memory can't be allocated, the
+   old table is kept and false is returned.  */
+bool
+resize_hash(int hsize)
+{
+	size_t nbuckets;
+	void *mem;
+
+	ASSERT(1, hsize > 0);
+
+	nbuckets = ((size_t)hsize * 0x100000) / sizeof(HashBucket);
+	if (hash_mem != NULL && nbuckets == settings.hash_size) {
+		clear_hash_table();
+		return true;
+	}
+
+	mem = malloc(nbuckets * sizeof(HashBucket) + 63);
+	if (mem == NULL) {
+		my_perror("Can't allocate %d MB for the hash table", hsize);
+		return false;
+	}
+	destroy_hash();
+	hash_mem = mem;
+	hash_table = (HashBucket *)(((size_t)hash_mem + 63) & ~(size_t)63);
+	settings.hash_size = nbuckets;
+	clear_hash_table();
+
+	return true;
+}
+
+/* Clear the hash table.  */
+void
+clear_hash(void)
+{
+	ASSERT(1, hash_table != NULL);
+	clear_hash_table();
+}
+
+/* Start a new search generation. Entries stored by the previous
+   searches are replaced before the current search's entries.  */
+void
+new_hash_generation(void)
+{
+	hash_gen = (hash_gen + 1) & GEN_MASK;
+}
+
 /* Initialize the zobrist values.  */
 void
 init_zobrist(void)
@@ -124,8 +342,9 @@ init_zobrist(void)
 void
 destroy_hash(void)
 {
-	if (hash_table != NULL) {
-		free(hash_table);
+	if (hash_mem != NULL) {
+		free(hash_mem);
+		hash_mem = NULL;
 		hash_table = NULL;
 	}
 }
@@ -163,41 +382,53 @@ val_to_hash(int val, int ply)
 	return val;
 }
 
-/* Get the best move from the hash table.
-   If not successfull, return NULLMOVE.  */
+/* Get the best move of <board>'s position from the hash table.
+   The move is validated. If not successfull, return NULLMOVE.  */
 U32
-get_hash_move(U64 key)
+get_hash_move(const Board *board)
 {
-	Hash *hash = &hash_table[key % settings.hash_size];
+	Hash *hash;
 
-	if (hash->key == key)
-		return hash->best;
+	ASSERT(2, board != NULL);
+
+	hash = find_entry(get_bucket(board->posp->key), board->posp->key);
+	if (hash != NULL)
+		return validate_move(board, unpack_move(board, hash->best));
 	return NULLMOVE;
 }
 
-/* Probe the hash table for a score and the best move.
+/* Probe the hash table for a score and the best move of <board>'s
+   position. The best move isn't validated.
    If not successfull, return VAL_NONE.  */
 int
-probe_hash(int depth, int alpha, int beta, U64 key, U32 *best_move, int ply)
+probe_hash(const Board *board, int depth, int alpha, int beta, U32 *best_move, int ply)
 {
+	U64 key;
 	Hash *hash;
 
+	ASSERT(2, board != NULL);
 	ASSERT(2, best_move != NULL);
 
-	hash = &hash_table[key % settings.hash_size];
-	if (hash->key == key) {
-		*best_move = hash->best;
+	key = board->posp->key;
+	hash = find_entry(get_bucket(key), key);
+	if (hash != NULL) {
+		int flag = GET_HFLAG(hash);
+
+		/* The entry is still useful, so it belongs to the
+		   current search.  */
+		hash->age_flag = SET_AGE_FLAG(hash_gen, flag);
+		*best_move = unpack_move(board, hash->best);
 		if ((int)hash->depth >= depth) {
 			int val = val_from_hash(hash->val, ply);
 
-			if (hash->flag == H_EXACT)
+			if (flag == H_EXACT)
 				return val;
-			if (hash->flag == H_ALPHA) {
+			if (flag == H_ALPHA) {
 				if (val <= alpha)
 					return alpha;
 				if (val < beta)
 					return VAL_AVOID_NULL;
-			} else if (hash->flag == H_BETA && val >= beta)
+			} else if (flag == H_BETA && val >= beta)
 				return beta;
 		}
 	}
@@ -205,32 +436,95 @@ probe_hash(int depth, int alpha, int beta, U64 key, U32 *best_move, int ply)
 	return VAL_NONE;
 }
 
-/* Store a hash key and its score and best move in the hash table.  */
+/* Returns the replacement priority of a hash entry. Entries from the
+   previous searches are always replaced first.  */
+static int
+get_priority(const Hash *hash)
+{
+	int priority;
+
+	if (GET_HFLAG(hash) == H_NONE)
+		return -1000;
+	priority = hash->depth;
+	if (GET_HFLAG(hash) == H_EXACT)
+		priority += PV_PRIORITY;
+	if (GET_HGEN(hash) != hash_gen)
+		priority -= 500;
+	return priority;
+}
+
+/* Returns the entry with the lowest priority in the always-replace
+   tier of <bucket>, or the entry of <hkey> if it's already there.  */
+static Hash *
+get_replace_entry(HashBucket *bucket, U32 hkey)
+{
+	int i;
+	Hash *hash = &bucket->entry[1];
+
+	for (i = 1; i < HASH_BUCKET_SIZE; i++) {
+		Hash *tmp = &bucket->entry[i];
+		if (tmp->key == hkey && GET_HFLAG(tmp) != H_NONE)
+			return tmp;
+		if (get_priority(tmp) < get_priority(hash))
+			hash = tmp;
+	}
+	return hash;
+}
+
+/* Store a hash key and its score and best move in the hash table.
+
+   The first entry of a bucket is depth-preferred: it's replaced only by
+   a position with at least the same priority (depth), and the position
+   it held is moved to the always-replace tier. Other positions replace
+   the entry with the lowest priority in the always-replace tier.
+   A position is never stored twice in the same bucket.  */
 void
-store_hash(int depth, int val, Hashf flag, U64 key, U32 best_move, int root_ply)
+store_hash(int depth, int val, Hashf flag, U64 key, U32 best_move)
 {
 	int priority;
-	Hash *hash = &hash_table[key % settings.hash_size];
+	U32 hkey;
+	Hash *hash;
+	HashBucket *bucket;
 
-	priority = root_ply + depth;
+	bucket = get_bucket(key);
+	hkey = HASH_KEY(key);
+	priority = depth;
 	if (flag == H_EXACT)
 		priority += PV_PRIORITY;
 
-	/* If the existing hash entry is "newer" than the new one, it must be
-	   from a previous game and thus its priority should be 0. */
-	if (hash->priority - hash->depth > root_ply + PV_PRIORITY)
-		hash->priority = 0;
-
-	if (priority >= hash->priority) {
-		if ((key != hash->key || hash->best == NULLMOVE)
-		||  (best_move != NULLMOVE && flag != H_ALPHA))
-			hash->best = best_move;
-		hash->key = key;
-		hash->val = val;
-		hash->flag = (S8)flag;
-		hash->depth = depth;
-		hash->priority = priority;
-	}
+	hash = &bucket->entry[0];
+	if (priority >= get_priority(hash)) {
+		int i;
+
+		/* An older copy of the position in the always-replace tier
+		   could never be probed, so it's removed.  */
+		for (i = 1; i < HASH_BUCKET_SIZE; i++) {
+			Hash *tmp = &bucket->entry[i];
+			if (tmp->key == hkey && GET_HFLAG(tmp) != H_NONE)
+				tmp->age_flag = SET_AGE_FLAG(0, H_NONE);
+		}
+		if (hash->key != hkey && GET_HFLAG(hash) != H_NONE
+		&&  GET_HGEN(hash) == hash_gen)
+			*get_replace_entry(bucket, hash->key) = *hash;
+	} else if (hash->key == hkey && GET_HFLAG(hash) != H_NONE) {
+		/* The deeper result of the same position stays in the first
+		   entry. A second copy of the position would never be probed,
+		   so only the best move and the generation are updated.  */
+		if (best_move != NULLMOVE && flag != H_ALPHA)
+			hash->best = PACK_MOVE(best_move);
+		hash->age_flag = SET_AGE_FLAG(hash_gen, GET_HFLAG(hash));
+		return;
+	} else
+		hash = get_replace_entry(bucket, hkey);
+
+	if ((hkey != hash->key || GET_HFLAG(hash) == H_NONE
+	||   hash->best == NULLMOVE)
+	||  (best_move != NULLMOVE && flag != H_ALPHA))
+		hash->best = PACK_MOVE(best_move);
+	hash->key = hkey;
+	hash->val = val;
+	hash->depth = depth;
+	hash->age_flag = SET_AGE_FLAG(hash_gen, flag);
 }
 
 /* Generate the hash key for a board position.  */
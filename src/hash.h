@@ -28,17 +28,41 @@ typedef struct _Zobrist
 //#   pragma pack(1)
 #endif /* not __GNUC__ */
 
-/* Data structure for a hash table entry.  */
+/* Data structure for a hash table entry. Only the upper half of the
+   hash key is stored, because the lower bits already select the entry.
+   The entry takes 10 bytes.  */
 typedef struct _Hash
 {
-	S8 depth;
-	S16 priority;	/* replace treshold */
-	S8 flag;	/* hash entry type */
+	U32 key;	/* upper 32 bits of the hash key */
+	U16 best;	/* best move in the 16-bit format */
 	S16 val;
-	U32 best;
-	U64 key;
+	S8 depth;
+	U8 age_flag;	/* search generation (bits 3-8) and entry type (bits 1-2) */
 } __attribute__ ((__packed__)) Hash;
 
+/* The number of entries in a hash bucket.  */
+#define HASH_BUCKET_SIZE 3
+
+/* A bucket of hash entries. The first entry is depth-preferred, and the
+   others are replaced always, so that every new position gets stored
+   somewhere. The bucket is padded to 32 bytes, so that it never crosses
+   a cache line.  */
+typedef struct _HashBucket
+{
+	Hash entry[HASH_BUCKET_SIZE];
+	U8 padding[32 - HASH_BUCKET_SIZE * sizeof(Hash)];
+} HashBucket;
+
+/* Hash table usage, sampled from the beginning of the table.
+   The values are in per mille of the sampled entries.  */
+typedef struct _HashStats
+{
+	int full;	/* entries in use */
+	int current;	/* entries of the current (or last) search */
+	int previous;	/* entries of the previous search */
+	int older;	/* entries of older searches */
+} HashStats;
+
 
 /* Random values for everything that's needed in a hash key (side to move,
    enpassant square, castling rights, and piece positions).  */
@@ -52,6 +76,27 @@ extern void set_hash_size(int hsize);
 /* Initialize the hash table.  */
 extern void init_hash(void);
 
+/* Change the hash table size to <hsize> megabytes and clear the table,
+   without stopping the program. If the memory can't be allocated, the
+   old table is kept and false is returned.  */
+extern bool resize_hash(int hsize);
+
+/* Clear the hash table.  */
+extern void clear_hash(void);
+
+/* Prefetch the hash table bucket of <key> into the cache.  */
+extern void prefetch_hash(U64 key);
+
+/* Sample the hash table usage into <stats>.  */
+extern void get_hash_stats(HashStats *stats);
+
+/* Print the hash table size and a sample of its usage.  */
+extern void print_hash_stats(void);
+
+/* Start a new search generation. Entries stored by the previous
+   searches are replaced before the current search's entries.  */
+extern void new_hash_generation(void);
+
 /* Initialize the zobrist values.  */
 extern void init_zobrist(void);
 
@@ -65,16 +110,17 @@ extern int val_from_hash(int val, int ply);
 /* Convert a search value into a hash value.  */
 extern int val_to_hash(int val, int ply);
 
-/* Get the best move from the hash table.
-   If not successfull, return NULLMOVE.  */
-extern U32 get_hash_move(U64 key);
+/* Get the best move of <board>'s position from the hash table.
+   The move is validated. If not successfull, return NULLMOVE.  */
+extern U32 get_hash_move(const Board *board);
 
-/* Probe the hash table for a score and the best move.
+/* Probe the hash table for a score and the best move of <board>'s
+   position. The best move isn't validated.
    If not successfull, return VAL_NONE.  */
-extern int probe_hash(int depth, int alpha, int beta, U64 key, U32 *best_move, int ply);
+extern int probe_hash(const Board *board, int depth, int alpha, int beta, U32 *best_move, int ply);
 
 /* Store a hash key and its score and best move in the hash table.  */
-extern void store_hash(int depth, int val, Hashf flag, U64 key, U32 best_move, int root_ply);
+extern void store_hash(int depth, int val, Hashf flag, U64 key, U32 best_move);
 
 /* Generate the hash key for a board position.  */
 extern void comp_hash_key(Board *board);
@@ -32,9 +32,12 @@
 #include "debug.h"
 #include "util.h"
 #include "eval.h"
+#include "hash.h"
 #include "pgn.h"
+#include "book.h"
 #include "perft.h"
 #include "bench.h"
+#include "attacks.h"
 #include "xboard.h"
 
 
@@ -47,13 +50,19 @@ typedef enum _SloppyId
 	SLID_PRINTEVAL,
 	SLID_PRINTMAT,
 	SLID_PRINTKEY,
+	SLID_HASHSTATS,
+	SLID_HASH,
+	SLID_PAWNHASH,
+	SLID_CLEARHASH,
 	SLID_PRINTMOVES,
 	SLID_TESTSEE,
 	SLID_PERFT,
 	SLID_DIVIDE,
 	SLID_READPGNLIST,
 	SLID_READPGN,
+	SLID_MAKEBOOK,
 	SLID_BENCH,
+	SLID_MICROBENCH,
 	SLID_TESTPOS,
 	SLID_TESTSUITE,
 	SLID_HELP,
@@ -76,13 +85,19 @@ static SloppyCmd slcmds[] =
 	{ SLID_PRINTEVAL, "printeval", CMDT_EXEC_AND_CONTINUE },
 	{ SLID_PRINTMAT, "printmat", CMDT_EXEC_AND_CONTINUE },
 	{ SLID_PRINTKEY, "printkey", CMDT_EXEC_AND_CONTINUE },
+	{ SLID_HASHSTATS, "hashstats", CMDT_EXEC_AND_CONTINUE },
+	{ SLID_HASH, "hash", CMDT_CANCEL },
+	{ SLID_PAWNHASH, "pawnhash", CMDT_CANCEL },
+	{ SLID_CLEARHASH, "clearhash", CMDT_CANCEL },
 	{ SLID_PRINTMOVES, "printmoves", CMDT_EXEC_AND_CONTINUE },
 	{ SLID_TESTSEE, "testsee", CMDT_EXEC_AND_CONTINUE },
 	{ SLID_PERFT, "perft", CMDT_CANCEL },
 	{ SLID_DIVIDE, "divide", CMDT_CANCEL },
 	{ SLID_READPGNLIST, "readpgnlist", CMDT_CANCEL },
 	{ SLID_READPGN, "readpgn", CMDT_CANCEL },
+	{ SLID_MAKEBOOK, "makebook", CMDT_CANCEL },
 	{ SLID_BENCH, "bench", CMDT_CANCEL },
+	{ SLID_MICROBENCH, "microbench", CMDT_CANCEL },
 	{ SLID_TESTPOS, "testpos", CMDT_CANCEL },
 	{ SLID_TESTSUITE, "testsuite", CMDT_CANCEL },
 	{ SLID_HELP, "help", CMDT_EXEC_AND_CONTINUE }
@@ -131,9 +146,15 @@ print_help(void)
 {
 	printf("Accepted commands:\n\n"
 	       "bench - runs Sloppy's own benchmark\n"
+	       "clearhash - clears the hash tables\n"
 	       "debug - toggles debugging mode\n"
 	       "divide [depth] - perft with a node count for each root move\n"
+	       "hash [MB] - sets the hash table size and clears the table\n"
+	       "hashstats - prints the hash table size and usage\n"
 	       "help - shows this list\n"
+	       "makebook [file] - creates a new book from a pgn file\n"
+	       "microbench - compares the speed of the attack table backends\n"
+	       "pawnhash [MB] - sets the pawn hash table size and clears the table\n"
 	       "perft [depth] - runs the perft test [depth] plies deep\n"
 	       "printboard - prints an ASCII chess board and the FEN string\n"
 	       "printeval - prints the static evaluation\n"
@@ -149,6 +170,25 @@ print_help(void)
 	       "xboard - switches to Xboard/Winboard mode\n\n");
 }
 
+/* Resize the hash table (or the pawn hash table if <pawn> is true)
+   to <param> megabytes.  */
+static void
+input_hash(const char *param, bool pawn)
+{
+	int hsize;
+
+	if (param == NULL || (hsize = atoi(param)) <= 0) {
+		printf("The hash size has to be at least 1 MB.\n");
+		return;
+	}
+	if (pawn) {
+		if (resize_pawn_hash(hsize))
+			printf("Pawn hash table size: %lu KB\n",
+			       (unsigned long)(get_pawn_hash_size() / 0x400));
+	} else if (resize_hash(hsize))
+		print_hash_stats();
+}
+
 static void
 input_perft(Board *board, const char *param, bool divide)
 {
@@ -177,6 +217,36 @@ input_perft(Board *board, const char *param, bool divide)
 	       (double)nnodes / ((double)timer / 1000.0));
 }
 
+/* Write the positions of PGN files straight to the book file, and
+   reload the book. If <merge> is true, the positions are merged with
+   the old book, otherwise the old book is replaced.
+   Returns the number of new positions, or -1 on error.  */
+static int
+pgn_files_to_book(Chess *chess, const char * const *filenames, int nfiles,
+                  bool merge)
+{
+	int npos;
+
+	ASSERT(1, chess != NULL);
+	ASSERT(1, filenames != NULL);
+
+	/* The book file is replaced, so it can't stay open.  */
+	close_book();
+	npos = pgn_to_book(filenames, nfiles, settings.book_file, merge);
+
+	/* Reload the book, even if it wasn't replaced.  */
+	if (settings.book_type == BOOK_MEM && file_exists(settings.book_file))
+		book_to_tree(settings.book_file, &chess->book);
+	else if (settings.book_type == BOOK_MAP
+	&&       map_book(settings.book_file) != 0)
+		settings.book_type = BOOK_OFF;
+
+	return npos;
+}
+
+/* In the "book in memory" mode PGN files are imported to the AVL tree,
+   which is written to the book file at exit. In the other book modes
+   the positions are merged with the book file immediately.  */
 static void
 input_readpgn(Chess *chess, const char *param)
 {
@@ -188,7 +258,12 @@ input_readpgn(Chess *chess, const char *param)
 	ASSERT(1, param != NULL);
 
 	timer = get_ms();
-	npos = pgn_to_tree(param, &chess->book);
+	if (settings.book_type == BOOK_MEM)
+		npos = pgn_to_tree(param, &chess->book);
+	else
+		npos = pgn_files_to_book(chess, &param, 1, true);
+	if (npos < 0)
+		return;
 
 	sec = (double)(get_ms() - timer) / 1000.0;
 	printf("PGN file read in %.2f seconds.\n", sec);
@@ -200,6 +275,9 @@ input_readpgnlist(Chess *chess, const char *param)
 {
 	FILE *fp;
 	char filename[MAX_BUF];
+	char **filenames = NULL;
+	int i;
+	int nfiles = 0;
 	S64 timer;
 	int npos = 0;
 	double sec;
@@ -215,16 +293,58 @@ input_readpgnlist(Chess *chess, const char *param)
 	timer = get_ms();
 
 	while (fgetline(filename, MAX_BUF, fp) != EOF) {
-		if (strlen(filename) > 2)
+		char **tmp;
+		size_t len = strlen(filename);
+
+		if (len <= 2)
+			continue;
+		if (settings.book_type == BOOK_MEM) {
 			npos += pgn_to_tree(filename, &chess->book);
+			continue;
+		}
+		/* All the files are merged with the book in one pass.  */
+		tmp = realloc(filenames, (nfiles + 1) * sizeof(char*));
+		if (tmp == NULL || (tmp[nfiles] = malloc(len + 1)) == NULL)
+			fatal_error("Couldn't allocate memory");
+		filenames = tmp;
+		strlcpy(filenames[nfiles++], filename, len + 1);
 	}
-
 	my_close(fp, param);
+
+	if (nfiles > 0) {
+		npos = pgn_files_to_book(chess, (const char * const*)filenames,
+		                         nfiles, true);
+		for (i = 0; i < nfiles; i++)
+			free(filenames[i]);
+		free(filenames);
+		if (npos < 0)
+			return;
+	}
+
 	sec = (double)(get_ms() - timer) / 1000.0;
 	printf("PGN file(s) read in %.2f seconds.\n", sec);
 	printf("%d new positions were stored in the book.\n", npos);
 }
 
+static void
+input_makebook(Chess *chess, const char *param)
+{
+	S64 timer;
+	int npos;
+	double sec;
+	
+	ASSERT(1, chess != NULL);
+	ASSERT(1, param != NULL);
+
+	timer = get_ms();
+	if ((npos = pgn_files_to_book(chess, &param, 1, false)) < 0)
+		return;
+
+	sec = (double)(get_ms() - timer) / 1000.0;
+	printf("Book created in %.2f seconds.\n", sec);
+	printf("%d positions were stored in the book.\n", npos);
+}
+
 static void
 input_testpos(char **param, bool show_pv)
 {
@@ -380,6 +500,20 @@ read_input(Chess *chess)
 	case SLID_PRINTKEY:
 		printf("Hash key: %" PRIu64 "\n", board->posp->key);
 		break;
+	/* Print the hash table usage. The entries of the current search
+	   are the ones stored or found by the last search.  */
+	case SLID_HASHSTATS:
+		print_hash_stats();
+		break;
+	/* Resize the hash tables without restarting the program.  */
+	case SLID_HASH: case SLID_PAWNHASH:
+		input_hash(param, (slcmd->id == SLID_PAWNHASH));
+		break;
+	case SLID_CLEARHASH:
+		clear_hash();
+		clear_pawn_hash();
+		printf("Hash tables cleared\n");
+		break;
 	/* Test the static exchange evaluator.
 	   Usage: testsee move fen
 	   Example: testsee Nxd5 4k3/6q1/1n1r4/3b4/3r4/4NB2/3R4/4K2Q w - - 0 1
@@ -400,9 +534,15 @@ read_input(Chess *chess)
 	case SLID_READPGN:
 		input_readpgn(chess, param);
 		break;
+	case SLID_MAKEBOOK:
+		input_makebook(chess, param);
+		break;
 	case SLID_BENCH:
 		bench();
 		break;
+	case SLID_MICROBENCH:
+		attacks_bench();
+		break;
 	case SLID_TESTPOS:
 		input_testpos(&param, chess->show_pv);
 		break;
@@ -78,6 +78,8 @@ set_config_option(const char *opt_name, const char *opt_val)
 			settings.book_type = BOOK_MEM;
 		else if (strcmp(opt_val, "disk") == 0)
 			settings.book_type = BOOK_DISK;
+		else if (strcmp(opt_val, "map") == 0)
+			settings.book_type = BOOK_MAP;
 		else
 			my_error("config: invalid book mode: %s", opt_val);
 	} else if (strcmp(opt_name, "egbb_path") == 0) {
@@ -101,6 +103,13 @@ set_config_option(const char *opt_name, const char *opt_val)
 			settings.use_log = false;
 		else
 			my_error("config: invalid logfile mode: %s", opt_val);
+	} else if (strcmp(opt_name, "pseudo_legal") == 0) {
+		if (strcmp(opt_val, "on") == 0)
+			settings.pseudo_legal = true;
+		else if (strcmp(opt_val, "off") == 0)
+			settings.pseudo_legal = false;
+		else
+			my_error("config: invalid pseudo_legal mode: %s", opt_val);
 	} else if (strcmp(opt_name, "threads") == 0) {
 		int nthreads = atoi(opt_val);
 		if (nthreads > 0)
@@ -191,6 +200,8 @@ initialize(Chess *chess)
 #else /* not 64-bit */
 	printf("Optimized for 32-bit\n");
 #endif /* not 64-bit */
+	check_cpu_features();
+	printf("Bit operations: %s\n", get_bitop_info());
 	printf("\nInitializing...\n");
 
 	init_chess(chess);
@@ -200,7 +211,6 @@ initialize(Chess *chess)
 	init_movegen();
 	init_eval();
 	init_zobrist();
-	init_hash();
 
 	if (settings.nthreads < 1) {
 		int nproc = get_nproc();
@@ -212,7 +222,10 @@ initialize(Chess *chess)
 			settings.nthreads = 1;
 		}
 	} else
-		printf("Using %d threads (for perft)\n", settings.nthreads);
+		printf("Using %d threads\n", settings.nthreads);
+	/* A big hash table is cleared in parallel, so the number
+	   of threads must be known first.  */
+	init_hash();
 
 #ifdef WINDOWS
 	strlcpy(settings.book_file, BOOK_FILE, MAX_BUF);
@@ -247,11 +260,19 @@ initialize(Chess *chess)
 			settings.book_type = BOOK_OFF;
 		}
 		break;
+	case BOOK_MAP:
+		printf("Using \"book mapped to memory\" book mode\n");
+		if (!file_exists(settings.book_file)) {
+			printf("No opening book was found\n");
+			settings.book_type = BOOK_OFF;
+		} else if (map_book(settings.book_file) != 0)
+			settings.book_type = BOOK_OFF;
+		break;
 	case BOOK_OFF:
 		printf("Opening book is disabled\n");
 		break;
 	}
-	if (settings.use_learning && settings.book_type != BOOK_MEM) {
+	if (settings.use_learning && settings.book_type == BOOK_OFF) {
 		my_error("Can't use learning in this book mode");
 		settings.use_learning = false;
 	}
@@ -288,7 +309,7 @@ initialize(Chess *chess)
 	} else
 		printf("Endgame bitbases disabled\n");
 
-	hsize = (sizeof(Hash) * settings.hash_size) / 0x100000;
+	hsize = (sizeof(HashBucket) * settings.hash_size) / 0x100000;
 	printf("Hash table size: %lu MB\n", hsize);
 
 	printf("...Done\n\n");
@@ -331,7 +352,10 @@ main(void)
 
 	if (settings.book_type == BOOK_MEM)
 		write_book(settings.book_file, chess.book);
+	else
+		flush_learn_log(settings.book_file);
 	clear_avl(chess.book);
+	close_book();
 	unload_bitbases();
 	destroy_hash();
 	destroy_pawn_hash();
@@ -255,6 +255,11 @@ make_move(Board *board, U32 move)
 	board->all_pcs = *my_pcs | *op_pcs;
 	*key ^= zobrist.color;
 
+	/* The new pawn structure is evaluated soon, so start loading
+	   its pawn hash entry.  */
+	if (pc == PAWN || capt == PAWN)
+		prefetch_pawn_hash(*pawn_key);
+
 	board->color = !color;
 	(board->nmoves)++;
 	ASSERT(2, board->nmoves <= MAX_NMOVES_PER_GAME);
@@ -21,8 +21,9 @@
 #include "sloppy.h"
 #include "debug.h"
 #include "util.h"
-#include "magicmoves.h"
+#include "attacks.h"
 #include "movegen.h"
+#include "eval.h"
 
 
 /* Shift a bitboard's pieces forward, forward left or forward right.
@@ -52,6 +53,9 @@ typedef struct _MoveData
 	U64 pins;		/* pinned pieces */
 	U64 discov_chk;		/* pieces able to give a discovered check */
 	U64 target;		/* target mask for the moving piece */
+	int min_prom;		/* least valuable promotion piece to generate */
+	bool test_legal;	/* filter out moves that leave the king in check */
+	bool find_checks;	/* set the IS_CHECK bit of checking moves */
 } MoveData;
 
 
@@ -64,6 +68,23 @@ U64 bishop_xray[64];
 
 const U64 seventh_rank[2] = { 0x000000000000FF00, 0x00FF000000000000 };
 
+/* The promotion rank.  */
+static const U64 eighth_rank[2] = { 0x00000000000000FF, 0xFF00000000000000 };
+
+
+/* A mask of squares that mustn't be checked by
+   the opponent when castling.  */
+static const U64 castle_check_mask[2][2] =
+{
+	{ 0x7000000000000000, 0x1C00000000000000 },
+	{ 0x0000000000000070, 0x000000000000001C }
+};
+/* A mask of squares that have to be empty for a castling move
+   to be legal.  */
+static const U64 castle_empty_mask[2][2] = {
+	{ 0x6000000000000000, 0x0e00000000000000 },
+	{ 0x0000000000000060, 0x000000000000000e }
+};
 
 /* A mask of a straight vertical, horizontal or diagonal line
    between two squares. The two squares are also included in the mask.
@@ -288,7 +309,7 @@ init_pawn_captures(void)
 void
 init_movegen(void)
 {
-	initmagicmoves();
+	init_attacks();
 	init_xrays();
 	init_connect_and_pin_masks();
 	init_pawn_captures();
@@ -314,55 +335,31 @@ board_is_check(const Board *board)
 
 	if ((move_masks.pawn_capt[color][king_sq] & op_pcs[PAWN])
 	||  (move_masks.knight[king_sq] & op_pcs[KNIGHT])
-	||  (B_MAGIC(king_sq, board->all_pcs) & op_pcs[BQ])
-	||  (R_MAGIC(king_sq, board->all_pcs) & op_pcs[RQ]))
+	||  (B_ATTACKS(king_sq, board->all_pcs) & op_pcs[BQ])
+	||  (R_ATTACKS(king_sq, board->all_pcs) & op_pcs[RQ]))
 	//||  (move_masks.king[king_sq] & op_pcs[KING]))
 		return true;
 	return false;
 }
 
-/* Get a check threat mask, or a mask of squares where the opposing king
-   can't move without being checked.  */
-static U64
-get_threat_mask(const Board *board, int color)
+/* Returns true if <sq> is attacked by any of <color>'s pieces in <mask>
+   when the board's occupancy is <occ>.  */
+static bool
+sq_is_attacked(const Board *board, int sq, int color, U64 occ, U64 mask)
 {
-	int sq;
-	U64 mask;
-	U64 attacks;
-	U64 pcs;
-	
-	ASSERT(2, board != NULL);
-	
-	/* Create a mask of all pieces except for the opposing king. This
-	   allows the sliding attacks to go through him.  */
-	pcs = board->all_pcs ^ board->pcs[!color][KING];
+	const U64 *pcs;
 
-	/* Pawn threats.  */
-	attacks = (FWD_LEFT(board->pcs[color][PAWN], color) & FILE_A_G) |
-	          (FWD_RIGHT(board->pcs[color][PAWN], color) & FILE_B_H);
-
-	/* Knight threats.  */
-	mask = board->pcs[color][KNIGHT];
-	while (mask) {
-		sq = pop_lsb(&mask);
-		attacks |= move_masks.knight[sq];
-	}
-	/* Bishop (and queen) threats.  */
-	mask = board->pcs[color][BQ];
-	while (mask) {
-		sq = pop_lsb(&mask);
-		attacks |= B_MAGIC(sq, pcs);
-	}
-	/* Rook (and queen) threats.  */
-	mask = board->pcs[color][RQ];
-	while (mask) {
-		sq = pop_lsb(&mask);
-		attacks |= R_MAGIC(sq, pcs);
-	}
-	/* King threats.  */
-	attacks |= move_masks.king[board->king_sq[color]];
-	
-	return attacks;
+	ASSERT(2, board != NULL);
+	ASSERT(2, is_on_board(sq));
+
+	pcs = &board->pcs[color][ALL];
+	if ((move_masks.pawn_capt[!color][sq] & pcs[PAWN] & mask)
+	||  (move_masks.knight[sq] & pcs[KNIGHT] & mask)
+	||  (move_masks.king[sq] & pcs[KING] & mask)
+	||  (B_ATTACKS(sq, occ) & pcs[BQ] & mask)
+	||  (R_ATTACKS(sq, occ) & pcs[RQ] & mask))
+		return true;
+	return false;
 }
 
 /* How Sloppy knows if a move is a check:
@@ -418,9 +415,9 @@ move_is_check(const Board *board, U32 move, MoveData *md)
 			int ep = GET_EPSQ(move);
 			U64 all_pcs = board->all_pcs;
 			all_pcs ^= bit64[ep] | bit64[from] | bit64[to];
-			if (B_MAGIC(king_sq, all_pcs) & board->pcs[color][BQ])
+			if (B_ATTACKS(king_sq, all_pcs) & board->pcs[color][BQ])
 				return true;
-			if (R_MAGIC(king_sq, all_pcs) & board->pcs[color][RQ])
+			if (R_ATTACKS(king_sq, all_pcs) & board->pcs[color][RQ])
 				return true;
 		/* Direct check by promotion.  */
 		} else if (GET_PROM(move)) {
@@ -431,17 +428,17 @@ move_is_check(const Board *board, U32 move, MoveData *md)
 					return true;
 				break;
 			case BISHOP:
-				if (B_MAGIC(to, all_pcs) & bit64[king_sq])
+				if (B_ATTACKS(to, all_pcs) & bit64[king_sq])
 					return true;
 				break;
 			case ROOK:
-				if (R_MAGIC(to, all_pcs) & bit64[king_sq])
+				if (R_ATTACKS(to, all_pcs) & bit64[king_sq])
 					return true;
 				break;
 			case QUEEN:
-				if (B_MAGIC(to, all_pcs) & bit64[king_sq])
+				if (B_ATTACKS(to, all_pcs) & bit64[king_sq])
 					return true;
-				if (R_MAGIC(to, all_pcs) & bit64[king_sq])
+				if (R_ATTACKS(to, all_pcs) & bit64[king_sq])
 					return true;
 				break;
 			}
@@ -490,7 +487,7 @@ move_is_check(const Board *board, U32 move, MoveData *md)
 			castle = GET_CASTLE(move);
 			rook_sq = castling.rook_sq[color][castle][C_TO];
 			all_pcs = board->all_pcs ^ board->pcs[color][KING];
-			if (R_MAGIC(rook_sq, all_pcs) & bit64[king_sq])
+			if (R_ATTACKS(rook_sq, all_pcs) & bit64[king_sq])
 				return true;
 		}
 		break;
@@ -510,12 +507,58 @@ simple_move(int pc, int from, int to, int prom)
 	return SET_FROM(from) | SET_TO(to) | SET_PC(pc) | SET_PROM(prom);
 }
 
-/* Form a new move and add it to a move list.  */
 #define CHECK_BIT 04000000000
+
+/* The castling bits of a move, for kingside and queenside castling.  */
+static const unsigned castle_bits[2] = { BIT(27U), BIT(28U) | BIT(27U) };
+
+/* Restore a full move from a 16-bit move (see PACK_MOVE() in sloppy.h)
+   by looking up the moving and captured pieces, and the enpassant and
+   castling data from <board>. The IS_CHECK bit isn't set, and the move
+   isn't validated, so it should go through validate_move().  */
+U32
+unpack_move(const Board *board, U16 move)
+{
+	int color;
+	int from;
+	int to;
+	int pc;
+	U32 full_move;
+
+	ASSERT(2, board != NULL);
+
+	if (move == NULLMOVE)
+		return NULLMOVE;
+
+	color = board->color;
+	from = move & 077;
+	to = (move >> 6) & 077;
+	pc = board->mailbox[from];
+	if (pc == 0)
+		return NULLMOVE;
+
+	full_move = SET_FROM(from) | SET_TO(to) | SET_PC(pc) |
+	            SET_PROM((move >> 12) & 07);
+	if (pc == PAWN && to != 0 && to == board->posp->ep_sq) {
+		full_move |= SET_CAPT(PAWN);
+		full_move |= SET_EPSQ(to + SIGN(color)*8);
+	} else
+		full_move |= SET_CAPT(board->mailbox[to]);
+
+	if (pc == KING && abs(from - to) == 2) {
+		if (to == castling.king_sq[color][C_KSIDE][C_TO])
+			full_move |= castle_bits[C_KSIDE];
+		else
+			full_move |= castle_bits[C_QSIDE];
+	}
+
+	return full_move;
+}
+
+/* Form a new move and add it to a move list.  */
 static void
 add_move(const Board *board, MoveData *md, MoveLst *move_list)
 {
-	const unsigned castle_bits[2] = { BIT(27U), BIT(28U) | BIT(27U) };
 	int pc;
 	int capt;
 	U32 move;
@@ -537,7 +580,7 @@ add_move(const Board *board, MoveData *md, MoveLst *move_list)
 	       SET_CAPT(capt) | SET_PROM(md->prom) | SET_EPSQ(md->ep_sq);
 	if (md->castle != -1)
 		move |= castle_bits[md->castle];
-	if (move_is_check(board, move, md))
+	if (md->find_checks && move_is_check(board, move, md))
 		move |= CHECK_BIT;
 	
 	move_list->move[(move_list->nmoves)++] = move;
@@ -565,10 +608,10 @@ add_pawn_capt(const Board *board, MoveData *md, MoveLst *move_list)
 
 	if (md->to && board->posp->ep_sq == md->to) {
 		md->ep_sq = md->to + SIGN(color)*8;
-		if (SQ_RANK(md->from) == SQ_RANK(king_sq)) {
+		if (md->test_legal && SQ_RANK(md->from) == SQ_RANK(king_sq)) {
 			U64 all_pcs = board->all_pcs;
 			all_pcs ^=  bit64[md->ep_sq] | bit64[md->from];
-			if (R_MAGIC(king_sq, all_pcs) & board->pcs[!color][RQ])
+			if (R_ATTACKS(king_sq, all_pcs) & board->pcs[!color][RQ])
 				return;
 		}
 	} else
@@ -645,7 +688,7 @@ add_pawn_move(const Board *board, MoveData *md, MoveLst *move_list)
 		return;
 
 	if (bit64[md->from] & seventh_rank[color]) {
-		for (md->prom = QUEEN; md->prom >= KNIGHT; md->prom--)
+		for (md->prom = QUEEN; md->prom >= md->min_prom; md->prom--)
 			add_move(board, md, move_list);
 	} else {
 		md->prom = 0;
@@ -748,7 +791,7 @@ gen_bishop_moves(const Board *board, MoveData *md, MoveLst *move_list)
 		U64 attacks;
 
 		md->from = pop_lsb(&mask);
-		attacks = B_MAGIC(md->from, board->all_pcs) & target;
+		attacks = B_ATTACKS(md->from, board->all_pcs) & target;
 		if (bit64[md->from] & md->pins)
 			attacks &= pin_mask[king_sq][md->from];
 		while (attacks) {
@@ -783,7 +826,7 @@ gen_rook_moves(const Board *board, MoveData *md, MoveLst *move_list)
 		U64 attacks;
 
 		md->from = pop_lsb(&mask);
-		attacks = R_MAGIC(md->from, board->all_pcs) & target;
+		attacks = R_ATTACKS(md->from, board->all_pcs) & target;
 		if (bit64[md->from] & md->pins)
 			attacks &= pin_mask[king_sq][md->from];
 		while (attacks) {
@@ -793,6 +836,33 @@ gen_rook_moves(const Board *board, MoveData *md, MoveLst *move_list)
 	}
 }
 
+/* Returns true if the king would be attacked in <to> after moving there
+   from <from>. Only the candidate square is tested, with the king removed
+   from the board so that the sliders' attacks go through him.  */
+static bool
+king_sq_is_attacked(const Board *board, int from, int to)
+{
+	return sq_is_attacked(board, to, !board->color,
+	                      board->all_pcs ^ bit64[from], ~0ULL);
+}
+
+/* Returns true if any of the squares the king passes through when
+   castling to <side> is attacked.  */
+static bool
+castle_path_is_attacked(const Board *board, int color, int side)
+{
+	U64 mask;
+
+	mask = castle_check_mask[color][side] &
+	       ~bit64[castling.king_sq[color][side][C_FROM]];
+	while (mask) {
+		if (sq_is_attacked(board, pop_lsb(&mask), !color,
+		                   board->all_pcs, ~0ULL))
+			return true;
+	}
+	return false;
+}
+
 /* Generate king captures.  */
 static void
 gen_king_capts(const Board *board, MoveData *md, MoveLst *move_list)
@@ -807,14 +877,15 @@ gen_king_capts(const Board *board, MoveData *md, MoveLst *move_list)
 	md->prom = 0;
 	md->ep_sq = 0;
 	md->castle = -1;
-	target = ~get_threat_mask(board, !board->color) & md->target;
-
 	md->from = board->king_sq[board->color];
+	target = board->pcs[!board->color][ALL] & md->target;
 
 	attacks = move_masks.king[md->from] & target;
 	while (attacks) {
 		md->to = pop_lsb(&attacks);
-		add_move(board, md, move_list);
+		if (!md->test_legal
+		||  !king_sq_is_attacked(board, md->from, md->to))
+			add_move(board, md, move_list);
 	}
 }
 
@@ -825,22 +896,8 @@ gen_king_moves(const Board *board, MoveData *md, MoveLst *move_list)
 	int color;
 	int i;
 	U64 attacks;
-	U64 threats;
 	U64 target;
-	
-	/* A mask of squares that mustn't be checked by
-	   the opponent when castling.  */
-	static const U64 castle_check_mask[2][2] =
-	{
-		{ 0x7000000000000000, 0x1C00000000000000 },
-		{ 0x0000000000000070, 0x000000000000001C }
-	};
-	/* A mask of squares that have to be empty for a castling move
-	   to be legal.  */
-	static const U64 castle_empty_mask[2][2] = {
-		{ 0x6000000000000000, 0x0e00000000000000 },
-		{ 0x0000000000000060, 0x000000000000000e }
-	};
+
 
 	ASSERT(2, board != NULL);
 	ASSERT(2, md != NULL);
@@ -851,14 +908,15 @@ gen_king_moves(const Board *board, MoveData *md, MoveLst *move_list)
 	md->ep_sq = 0;
 	md->castle = -1;
 	md->from = board->king_sq[color];
-	threats = get_threat_mask(board, !color);
-	target = ~threats & md->target;
+	target = ~board->pcs[color][ALL] & md->target;
 
 	/* Normal moves (not castling moves).  */
 	attacks = move_masks.king[md->from] & target;
 	while (attacks) {
 		md->to = pop_lsb(&attacks);
-		add_move(board, md, move_list);
+		if (!md->test_legal
+		||  !king_sq_is_attacked(board, md->from, md->to))
+			add_move(board, md, move_list);
 	}
 
 	/* Castling moves
@@ -866,7 +924,7 @@ gen_king_moves(const Board *board, MoveData *md, MoveLst *move_list)
 	   If the king is not in square E1 (white) or E8 (black), if it
 	   doesn't have any castling rights left, or if the king is in
 	   check, castling isn't possible.  */
-	if (bit64[md->from] & threats
+	if (board->posp->in_check
 	|| md->from != castling.king_sq[color][C_KSIDE][C_FROM]
 	|| !(board->posp->castle_rights & castling.all_rights[color]))
 		return;
@@ -874,11 +932,13 @@ gen_king_moves(const Board *board, MoveData *md, MoveLst *move_list)
 	for (i = 0; i < 2; i++) {
 		int rook_sq = castling.rook_sq[color][i][C_FROM];
 		md->to = castling.king_sq[color][i][C_TO];
+		/* The king is known not to be in check, so only the two
+		   squares it passes through need to be tested.  */
 		if ((board->posp->castle_rights & castling.rights[color][i])
 		&& !(board->all_pcs & castle_empty_mask[color][i])
-		&& !(threats & castle_check_mask[color][i])
 		&& (bit64[md->to] & target)
-		&& (board->pcs[color][ROOK] & bit64[rook_sq])) {
+		&& (board->pcs[color][ROOK] & bit64[rook_sq])
+		&& !castle_path_is_attacked(board, color, i)) {
 			md->castle = i;
 			add_move(board, md, move_list);
 		}
@@ -905,22 +965,22 @@ get_pins(const Board *board, int color, int pinned_color)
 		U64 b1 = board->all_pcs;
 		U64 b3;
 		
-		U64 b2 = B_MAGIC(king_sq, b1);
+		U64 b2 = B_ATTACKS(king_sq, b1);
 		pinners &= ~b2;
 		b2 &= board->pcs[pinned_color][ALL];
 		while (b2) {
 			b3 = b2 & -b2;
 			b2 ^= b3;
-			if (B_MAGIC(king_sq, b1 ^ b3) & pinners) pins |= b3;
+			if (B_ATTACKS(king_sq, b1 ^ b3) & pinners) pins |= b3;
 		}
 
-		b2 = R_MAGIC(king_sq, b1);
+		b2 = R_ATTACKS(king_sq, b1);
 		pinners &= ~b2;
 		b2 &= board->pcs[pinned_color][ALL];
 		while (b2) {
 			b3 = b2 & -b2;
 			b2 ^= b3;
-			if (R_MAGIC(king_sq, b1 ^ b3) & pinners) pins |= b3;
+			if (R_ATTACKS(king_sq, b1 ^ b3) & pinners) pins |= b3;
 		}
 		
 		return pins;
@@ -949,8 +1009,8 @@ get_check_mask(const Board *board)
 		(move_masks.pawn_capt[board->color][king_sq] & op_pcs[PAWN]) |
 		(move_masks.knight[king_sq] & op_pcs[KNIGHT]);
 	sliders =
-		(B_MAGIC(king_sq, board->all_pcs) & op_pcs[BQ]) |
-		(R_MAGIC(king_sq, board->all_pcs) & op_pcs[RQ]);
+		(B_ATTACKS(king_sq, board->all_pcs) & op_pcs[BQ]) |
+		(R_ATTACKS(king_sq, board->all_pcs) & op_pcs[RQ]);
 
 	if (check_mask == 0 && sliders == 0)
 		return 0;
@@ -961,9 +1021,11 @@ get_check_mask(const Board *board)
 	return check_mask;
 }
 
-/* Generate some bitmasks for move generation.  */
+/* Generate some bitmasks for move generation. If <flags> has MG_PSEUDO,
+   the pins aren't needed because the legality test is left for
+   move_is_legal().  */
 static void
-gen_movegen_masks(const Board *board, MoveData *md)
+gen_movegen_masks(const Board *board, MoveData *md, int flags)
 {
 	int color;
 	int king_sq;
@@ -974,15 +1036,89 @@ gen_movegen_masks(const Board *board, MoveData *md)
 	color = board->color;
 	king_sq = board->king_sq[!color];
 	
-	md->b_chk = B_MAGIC(king_sq, board->all_pcs);
-	md->r_chk = R_MAGIC(king_sq, board->all_pcs);
-	md->pins = get_pins(board, color, color);
+	md->min_prom = KNIGHT;
+	md->test_legal = !(flags & MG_PSEUDO);
+	md->find_checks = true;
+	md->b_chk = B_ATTACKS(king_sq, board->all_pcs);
+	md->r_chk = R_ATTACKS(king_sq, board->all_pcs);
 	md->discov_chk = get_pins(board, !color, color);
+	if (md->test_legal)
+		md->pins = get_pins(board, color, color);
+	else
+		md->pins = 0;
+}
+
+/* Generate non-capturing checks, except promotions. Unless a discovered
+   check is possible, only the moves to squares that could check the
+   opposing king are generated. The moves are then filtered by their
+   IS_CHECK bit.  */
+static void
+gen_quiet_checks(const Board *board, MoveData *md, MoveLst *move_list)
+{
+	int color;
+	int king_sq;
+	int i;
+	int n;
+	U64 target;
+
+	ASSERT(2, board != NULL);
+	ASSERT(2, md != NULL);
+	ASSERT(2, move_list != NULL);
+	ASSERT(2, md->find_checks);
+
+	color = board->color;
+	king_sq = board->king_sq[!color];
+	n = move_list->nmoves;
+
+	target = ~board->all_pcs;
+	if (!md->discov_chk)
+		target &= move_masks.pawn_capt[!color][king_sq] |
+		          move_masks.knight[king_sq] | md->b_chk | md->r_chk;
+
+	md->target = target & ~eighth_rank[color];
+	gen_pawn_moves(board, md, move_list);
+	md->target = target;
+	if (md->discov_chk & board->pcs[color][KING])
+		gen_king_moves(board, md, move_list);
+	gen_knight_moves(board, md, move_list);
+	gen_bishop_moves(board, md, move_list);
+	gen_rook_moves(board, md, move_list);
+
+	for (i = n; i < move_list->nmoves; i++) {
+		if (IS_CHECK(move_list->move[i]))
+			move_list->move[n++] = move_list->move[i];
+	}
+	move_list->nmoves = n;
+}
+
+/* Remove the captures and promotions that lose material according to
+   SEE, and store the SEE value of the remaining ones as their score.  */
+static void
+dismiss_bad_capts(const Board *board, MoveLst *move_list)
+{
+	int i;
+	int n;
+
+	ASSERT(2, board != NULL);
+	ASSERT(2, move_list != NULL);
+
+	for (i = n = 0; i < move_list->nmoves; i++) {
+		U32 move = move_list->move[i];
+
+		if (GET_CAPT(move) || GET_PROM(move)) {
+			int score = see(board, move, board->color);
+			if (score <= -VAL_PAWN)
+				continue;
+			move_list->score[n] = score;
+		}
+		move_list->move[n++] = move;
+	}
+	move_list->nmoves = n;
 }
 
 /* Generate moves that are played in the quiescence search.  */
 void
-gen_qs_moves(const Board *board, MoveLst *move_list)
+gen_qs_moves(const Board *board, MoveLst *move_list, int flags)
 {
 	int color;
 	MoveData md;
@@ -995,13 +1131,121 @@ gen_qs_moves(const Board *board, MoveLst *move_list)
 	move_list->nmoves = 0;
 
 	md.target = board->pcs[!color][ALL];
-	gen_movegen_masks(board, &md);
+	if ((flags & MG_PSEUDO) && !(flags & MG_CHECKS)) {
+		/* The captures are ordered by SEE, so the checks can be
+		   detected by verify_move() when the move is tried.  */
+		md.min_prom = KNIGHT;
+		md.test_legal = false;
+		md.find_checks = false;
+		md.pins = 0;
+	} else
+		gen_movegen_masks(board, &md, flags);
 
 	gen_king_capts(board, &md, move_list);
 	gen_pawn_capts(board, &md, move_list);
 	gen_knight_moves(board, &md, move_list);
 	gen_bishop_moves(board, &md, move_list);
 	gen_rook_moves(board, &md, move_list);
+
+	if (flags & MG_PROMS) {
+		md.target = ~board->all_pcs & eighth_rank[color];
+		md.min_prom = QUEEN;
+		gen_pawn_moves(board, &md, move_list);
+	}
+	if (flags & MG_CHECKS)
+		gen_quiet_checks(board, &md, move_list);
+	if (flags & MG_GOOD_SEE)
+		dismiss_bad_capts(board, move_list);
+}
+
+/* Generate all legal (or pseudo-legal with MG_PSEUDO) non-captures,
+   including castling moves and promotions (but not capturing
+   promotions).  */
+void
+gen_quiet_moves(const Board *board, MoveLst *move_list, int flags)
+{
+	MoveData md;
+
+	ASSERT(2, board != NULL);
+	ASSERT(2, move_list != NULL);
+	ASSERT(2, !board->posp->in_check);
+	
+	move_list->nmoves = 0;
+
+	md.target = ~board->all_pcs;
+	gen_movegen_masks(board, &md, flags);
+
+	gen_king_moves(board, &md, move_list);
+	gen_pawn_moves(board, &md, move_list);
+	gen_knight_moves(board, &md, move_list);
+	gen_bishop_moves(board, &md, move_list);
+	gen_rook_moves(board, &md, move_list);
+}
+
+/* Generate all legal check evasions: king moves, captures of the
+   checking piece and interpositions between the king and a checking
+   slider. Instead of walking through every piece, we look for the pieces
+   that attack the few target squares. Pinned pieces can't evade a check,
+   so they're excluded.  */
+void
+gen_evasions(const Board *board, MoveLst *move_list)
+{
+	int color;
+	int king_sq;
+	U64 checkers;
+	U64 target;
+	const U64 *my_pcs;
+	const U64 *op_pcs;
+	MoveData md;
+
+	ASSERT(2, board != NULL);
+	ASSERT(2, move_list != NULL);
+	ASSERT(2, board->posp->in_check);
+	ASSERT(2, board_is_check(board));
+
+	color = board->color;
+	king_sq = board->king_sq[color];
+	my_pcs = &board->pcs[color][ALL];
+	op_pcs = &board->pcs[!color][ALL];
+	move_list->nmoves = 0;
+
+	md.target = ~my_pcs[ALL];
+	gen_movegen_masks(board, &md, 0);
+	gen_king_moves(board, &md, move_list);
+
+	checkers =
+		(move_masks.pawn_capt[color][king_sq] & op_pcs[PAWN]) |
+		(move_masks.knight[king_sq] & op_pcs[KNIGHT]) |
+		(B_ATTACKS(king_sq, board->all_pcs) & op_pcs[BQ]) |
+		(R_ATTACKS(king_sq, board->all_pcs) & op_pcs[RQ]);
+	ASSERT(2, checkers != 0);
+	/* In a double check only the king can move.  */
+	if (checkers & (checkers - 1))
+		return;
+
+	/* <connect_mask> includes the checker, and it's empty if the checker
+	   isn't a slider.  */
+	target = connect_mask[king_sq][get_lsb(checkers)] | checkers;
+	md.target = target;
+	gen_pawn_moves(board, &md, move_list);
+	gen_pawn_capts(board, &md, move_list);
+
+	md.prom = 0;
+	md.ep_sq = 0;
+	md.castle = -1;
+	while (target) {
+		U64 pcs;
+
+		md.to = pop_lsb(&target);
+		pcs = (move_masks.knight[md.to] & my_pcs[KNIGHT]) |
+		      (B_ATTACKS(md.to, board->all_pcs) & my_pcs[BQ]) |
+		      (R_ATTACKS(md.to, board->all_pcs) & my_pcs[RQ]);
+		pcs &= ~md.pins;
+		while (pcs) {
+			md.from = pop_lsb(&pcs);
+			add_move(board, &md, move_list);
+		}
+	}
 }
 
 /* Generate all legal moves.  */
@@ -1014,24 +1258,18 @@ gen_moves(const Board *board, MoveLst *move_list)
 	ASSERT(2, board != NULL);
 	ASSERT(2, move_list != NULL);
 
+	if (board->posp->in_check) {
+		gen_evasions(board, move_list);
+		return;
+	}
+
 	color = board->color;
 	move_list->nmoves = 0;
 
 	md.target = ~board->pcs[color][ALL];
-	gen_movegen_masks(board, &md);
+	gen_movegen_masks(board, &md, 0);
 
 	gen_king_moves(board, &md, move_list);
-	if (board->posp->in_check) {
-		U64 check_mask = get_check_mask(board);
-		ASSERT(2, check_mask != 0);
-		ASSERT(2, board_is_check(board));
-		/* In a double check we only generate king moves
-		   because everything else is illegal.  */
-		if (popcount(check_mask & board->pcs[!color][ALL]) > 1)
-			return;
-		md.target &= check_mask;
-	}
-	
 	gen_pawn_moves(board, &md, move_list);
 	gen_pawn_capts(board, &md, move_list);
 	gen_knight_moves(board, &md, move_list);
@@ -1059,7 +1297,7 @@ gen_pc_moves(Board *board, MoveLst *move_list, int pc, int to)
 		to += SIGN(color)*8;
 
 	md.target = ~board->pcs[color][ALL] & bit64[to];
-	gen_movegen_masks(board, &md);
+	gen_movegen_masks(board, &md, 0);
 
 	if (pc == KING) {
 		gen_king_moves(board, &md, move_list);
@@ -1114,3 +1352,241 @@ gen_pc_moves(Board *board, MoveLst *move_list, int pc, int to)
 	}
 }
 
+/* Returns true if the piece <pc> of <color> in <sq> attacks <target>
+   when the board's occupancy is <occ>.  */
+static bool
+pc_attacks_sq(int pc, int color, int sq, int target, U64 occ)
+{
+	switch (pc) {
+	case PAWN:
+		return (move_masks.pawn_capt[color][sq] & bit64[target]) != 0;
+	case KNIGHT:
+		return (move_masks.knight[sq] & bit64[target]) != 0;
+	case BISHOP:
+		return (B_ATTACKS(sq, occ) & bit64[target]) != 0;
+	case ROOK:
+		return (R_ATTACKS(sq, occ) & bit64[target]) != 0;
+	case QUEEN:
+		return (Q_ATTACKS(sq, occ) & bit64[target]) != 0;
+	case KING:
+		return (move_masks.king[sq] & bit64[target]) != 0;
+	default:
+		return false;
+	}
+}
+
+/* Returns true if <move> is pseudo-legal in <board>, ie. it obeys the
+   rules for moving the piece, but may leave the king in check.  */
+static bool
+move_is_pseudo_legal(const Board *board, U32 move)
+{
+	int color;
+	int sign;
+	int from;
+	int to;
+	int pc;
+	int capt;
+	int prom;
+	int ep_sq;
+	U64 occ;
+	const U64 *my_pcs;
+
+	ASSERT(2, board != NULL);
+
+	color = board->color;
+	sign = SIGN(color);
+	from = GET_FROM(move);
+	to = GET_TO(move);
+	pc = GET_PC(move);
+	capt = GET_CAPT(move);
+	prom = GET_PROM(move);
+	ep_sq = GET_EPSQ(move);
+	occ = board->all_pcs;
+	my_pcs = &board->pcs[color][ALL];
+
+	if (pc < PAWN || pc > KING || from == to
+	||  !(my_pcs[pc] & bit64[from]) || (my_pcs[ALL] & bit64[to]))
+		return false;
+
+	/* The captured piece must match the board.  */
+	if (ep_sq) {
+		if (pc != PAWN || capt != PAWN || to != board->posp->ep_sq
+		||  ep_sq != to + sign*8)
+			return false;
+	} else if (board->mailbox[to] != capt || capt == KING)
+		return false;
+
+	/* Promotions.  */
+	if (pc == PAWN && (bit64[from] & seventh_rank[color])) {
+		if (prom < KNIGHT || prom > QUEEN)
+			return false;
+	} else if (prom)
+		return false;
+
+	if (IS_CASTLING(move)) {
+		int castle = GET_CASTLE(move);
+		int rook_sq = castling.rook_sq[color][castle][C_FROM];
+
+		if (pc != KING
+		||  from != castling.king_sq[color][castle][C_FROM]
+		||  to != castling.king_sq[color][castle][C_TO]
+		||  !(board->posp->castle_rights & castling.rights[color][castle])
+		||  (occ & castle_empty_mask[color][castle])
+		||  !(my_pcs[ROOK] & bit64[rook_sq]))
+			return false;
+		/* The king mustn't be in check or pass through an
+		   attacked square.  */
+		return !board->posp->in_check
+		&&     !castle_path_is_attacked(board, color, castle);
+	}
+
+	switch (pc) {
+	case PAWN:
+		if (capt)
+			return (move_masks.pawn_capt[color][from] & bit64[to]) != 0;
+		if (to == from - sign*8)
+			return true;
+		/* Double push from the second rank.  */
+		return (to == from - sign*16
+		&&  (bit64[from] & seventh_rank[!color])
+		&&  !(occ & bit64[from - sign*8]));
+	default:
+		return pc_attacks_sq(pc, color, from, to, occ);
+	}
+}
+
+/* Returns true if one of <color>'s sliders attacks <sq> through <from>
+   after a piece has moved from <from> to <to>, and the board's occupancy
+   is <occ>. The attacks are only looked up if the piece leaves a line
+   between <sq> and a slider, which is rare.  */
+static bool
+xray_through(const Board *board, int sq, int from, int to, int color, U64 occ)
+{
+	U64 ray;
+	U64 sliders;
+
+	ray = pin_mask[sq][from];
+	if (!ray || (bit64[to] & ray))
+		return false;
+
+	if (bishop_xray[sq] & bit64[from]) {
+		sliders = board->pcs[color][BQ] & ray & ~bit64[from];
+		return sliders && (B_ATTACKS(sq, occ) & sliders);
+	}
+	sliders = board->pcs[color][RQ] & ray & ~bit64[from];
+	return sliders && (R_ATTACKS(sq, occ) & sliders);
+}
+
+/* Returns the occupancy of <board> after <move>.  */
+static U64
+occ_after_move(const Board *board, U32 move)
+{
+	U64 occ;
+
+	occ = (board->all_pcs ^ bit64[GET_FROM(move)]) | bit64[GET_TO(move)];
+	if (GET_EPSQ(move))
+		occ ^= bit64[GET_EPSQ(move)];
+	return occ;
+}
+
+/* Returns true if the pseudo-legal <move> doesn't leave the king
+   in check.  */
+bool
+move_is_legal(const Board *board, U32 move)
+{
+	int color;
+	int from;
+	int to;
+	int pc;
+	int king_sq;
+	U64 occ;
+
+	ASSERT(2, board != NULL);
+	ASSERT(2, move != NULLMOVE);
+
+	color = board->color;
+	from = GET_FROM(move);
+	to = GET_TO(move);
+	pc = GET_PC(move);
+	king_sq = board->king_sq[color];
+	occ = occ_after_move(board, move);
+
+	if (pc == KING || GET_EPSQ(move) || board->posp->in_check) {
+		int capt_sq = GET_EPSQ(move) ? GET_EPSQ(move) : to;
+
+		/* A captured piece can't attack anything, so it's
+		   excluded from the attackers.  */
+		if (pc == KING)
+			king_sq = to;
+		return !sq_is_attacked(board, king_sq, !color, occ,
+		                       ~bit64[capt_sq]);
+	}
+	return !xray_through(board, king_sq, from, to, !color, occ);
+}
+
+/* Returns the pseudo-legal <move> with a correct IS_CHECK bit if it's
+   legal in <board>, or NULLMOVE if it leaves the king in check.  */
+U32
+verify_move(const Board *board, U32 move)
+{
+	int color;
+	int from;
+	int to;
+	int pc;
+	int king_sq;
+	U64 occ;
+
+	ASSERT(2, board != NULL);
+	ASSERT(2, move != NULLMOVE);
+
+	if (!move_is_legal(board, move))
+		return NULLMOVE;
+
+	color = board->color;
+	from = GET_FROM(move);
+	to = GET_TO(move);
+	pc = GET_PC(move);
+	occ = occ_after_move(board, move);
+
+	/* Detect checks.  */
+	move &= ~CHECK_BIT;
+	king_sq = board->king_sq[!color];
+	if (IS_CASTLING(move)) {
+		int castle = GET_CASTLE(move);
+		int rook_from = castling.rook_sq[color][castle][C_FROM];
+		int rook_to = castling.rook_sq[color][castle][C_TO];
+
+		occ = (occ ^ bit64[rook_from]) | bit64[rook_to];
+		if (R_ATTACKS(rook_to, occ) & bit64[king_sq])
+			move |= CHECK_BIT;
+	} else {
+		int new_pc = GET_PROM(move) ? GET_PROM(move) : pc;
+
+		/* Direct check.  */
+		if (pc_attacks_sq(new_pc, color, to, king_sq, occ))
+			move |= CHECK_BIT;
+		/* Discovered check. The enpassant capture also removes
+		   the captured pawn from the board.  */
+		else if (GET_EPSQ(move)) {
+			if ((B_ATTACKS(king_sq, occ) & board->pcs[color][BQ])
+			||  (R_ATTACKS(king_sq, occ) & board->pcs[color][RQ]))
+				move |= CHECK_BIT;
+		} else if (xray_through(board, king_sq, from, to, color, occ))
+			move |= CHECK_BIT;
+	}
+
+	return move;
+}
+
+/* Returns <move> with a correct IS_CHECK bit if it's a legal move in
+   <board>, or NULLMOVE if it isn't. This is needed for moves that don't
+   come straight from the move generator, like hash and killer moves.  */
+U32
+validate_move(const Board *board, U32 move)
+{
+	ASSERT(2, board != NULL);
+
+	if (move == NULLMOVE || !move_is_pseudo_legal(board, move))
+		return NULLMOVE;
+	return verify_move(board, move);
+}
@@ -7,6 +7,12 @@
 /* The maximum number of legal moves per position.  */
 #define MAX_NMOVES 128
 
+/* Flags for gen_qs_moves() and gen_quiet_moves().  */
+#define MG_PSEUDO 0x01	/* pseudo-legal moves, see verify_move() */
+#define MG_PROMS 0x02	/* gen_qs_moves(): non-capturing queen promotions */
+#define MG_CHECKS 0x04	/* gen_qs_moves(): non-capturing checks */
+#define MG_GOOD_SEE 0x08 /* gen_qs_moves(): no captures that lose material */
+
 /* Pre-calculated move bitmasks.  */
 typedef struct _MoveMasks
 {
@@ -38,8 +44,26 @@ extern bool board_is_check(const Board *board);
    squares, and the promotion piece.  */
 extern U32 simple_move(int pc, int from, int to, int prom);
 
-/* Generate moves that are tried in the quiescence search.  */
-extern void gen_qs_moves(const Board *board, MoveLst *move_list);
+/* Restore a full move from a 16-bit move (see PACK_MOVE()) in <board>.
+   The move doesn't have the IS_CHECK bit, and it may be illegal.  */
+extern U32 unpack_move(const Board *board, U16 move);
+
+/* Generate moves that are tried in the quiescence search: captures,
+   and optionally queen promotions (MG_PROMS) and checks (MG_CHECKS).
+   With MG_GOOD_SEE the captures and promotions that lose material are
+   left out, and the others get their SEE value as their score.
+   With the MG_PSEUDO flag the moves are pseudo-legal, and they don't
+   always have the IS_CHECK bit, so they must pass verify_move().  */
+extern void gen_qs_moves(const Board *board, MoveLst *move_list, int flags);
+
+/* Generate all legal non-captures, including castling and promotions.
+   With the MG_PSEUDO flag the moves are pseudo-legal, and they must
+   pass move_is_legal(). May not be called when the side to move is in check.  */
+extern void gen_quiet_moves(const Board *board, MoveLst *move_list, int flags);
+
+/* Generate all legal check evasions.
+   May only be called when the side to move is in check.  */
+extern void gen_evasions(const Board *board, MoveLst *move_list);
 
 /* Generate all legal moves.  */
 extern void gen_moves(const Board *board, MoveLst *move_list);
@@ -47,5 +71,17 @@ extern void gen_moves(const Board *board, MoveLst *move_list);
 /* Generate moves for a specific piece type with a specific <to> square.  */
 extern void gen_pc_moves(Board *board, MoveLst *move_list, int pc, int to);
 
+/* Returns true if the pseudo-legal <move> doesn't leave the king
+   in check.  */
+extern bool move_is_legal(const Board *board, U32 move);
+
+/* Returns the pseudo-legal <move> with a correct IS_CHECK bit if it's
+   legal in <board>, or NULLMOVE if it leaves the king in check.  */
+extern U32 verify_move(const Board *board, U32 move);
+
+/* Returns <move> with a correct IS_CHECK bit if it's a legal move in
+   <board>, or NULLMOVE if it isn't.  */
+extern U32 validate_move(const Board *board, U32 move);
+
 #endif /* MOVEGEN_H */
 
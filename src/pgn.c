@@ -18,6 +18,7 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include "sloppy.h"
@@ -27,218 +28,1075 @@
 #include "makemove.h"
 #include "book.h"
 #include "notation.h"
+#include "thread.h"
 #include "pgn.h"
 
 
 /* The number of half moves per game that can be stored in the opening book.  */
 #define MAX_BOOK_PLIES 26
 
+/* The initial size of an import job's position buffer.  */
+#define REC_BUF_SIZE 0x10000
+
+/* The max. number of positions that pgn_to_book() keeps in memory
+   (64 MB). When the buffers are full, they're written to temporary
+   files in sorted runs.  */
+#define BUILD_BUF_SIZE (0x4000000 / sizeof(BookEntry))
+
+/* The number of positions that are read at once from a temporary file
+   in the merge.  */
+#define RUN_BUF_SIZE 0x1000
+
+/* The initial size of a PGN reader's buffer. The buffer grows if a token
+   doesn't fit in it.  */
+#define PGN_BUF_SIZE 0x100000
+
 typedef enum _PgnResult
 {
 	DRAWN_GAME, WHITE_WINS, BLACK_WINS, NO_RESULT, RESULT_ERROR
 } PgnResult;
 
-/* Find the next PGN game in a stream and return the result.  */
-static PgnResult
-get_pgn_result(FILE *fp)
-{
-	char line[MAX_BUF];
-
-	while (fgetline(line, MAX_BUF, fp) >= 0) {
-		if (!strncmp(line, "[Result ", 8)) {
-			if (strstr(line, "1-0") != NULL)
-				return WHITE_WINS;
-			else if (strstr(line, "0-1") != NULL)
-				return BLACK_WINS;
-			else if (strstr(line, "1/2-1/2") != NULL)
-				return DRAWN_GAME;
-			else
-				return NO_RESULT;
+/* Token types of the PGN tokenizer.  */
+typedef enum _PgnToken
+{
+	TOK_TAG,	/* tag pair line, eg. [Result "1-0"] */
+	TOK_SAN,	/* word that starts with a letter, ie. a move */
+	TOK_COMMENT,	/* {brace} comment or ;rest of line comment */
+	TOK_VARIATION,	/* (recursive variation) */
+	TOK_OTHER,	/* move number, game result, NAG, etc. */
+	TOK_EOF
+} PgnToken;
+
+/* A string in the buffer of a PGN reader. It isn't null-terminated, and
+   it's valid only until the reader reads the next token or line.  */
+typedef struct _StrView
+{
+	const char *str;
+	size_t len;
+} StrView;
+
+/* A buffered PGN file reader. The file is read in big blocks, and
+   the tokens and lines point directly to the buffer.  */
+typedef struct _PgnReader
+{
+	FILE *fp;
+	const char *filename;
+	char *buf;
+	size_t size;		/* allocated size of <buf> */
+	size_t len;		/* num. of bytes in <buf> */
+	size_t pos;		/* read position in <buf> */
+	long offset;		/* file offset of buf[0] */
+	bool eof;		/* the end of the file is in <buf> */
+} PgnReader;
+
+/* A part of a PGN file that's read by one thread, and the positions
+   found in it. The positions are sorted and their duplicates are summed
+   whenever the buffer gets full, and after the last game. If the buffer
+   can't grow anymore, it's written to a temporary file as a sorted run.  */
+typedef struct _PgnJob
+{
+	const char *filename;
+	int version;		/* format version of the book */
+	long start;		/* offset of the first game */
+	long end;		/* offset of the next job's first game */
+	bool show_progress;	/* display a progressbar */
+	bool error;		/* the file couldn't be read */
+	int ngames;		/* num. of games read */
+	BookEntry *recs;	/* positions or moves */
+	size_t nrecs;		/* num. of positions in <recs> */
+	size_t size;		/* allocated size of <recs> */
+	size_t max_size;	/* max. size of <recs>, or 0 for no limit */
+	FILE **runs;		/* temporary files of sorted runs */
+	int nruns;		/* num. of temporary files */
+} PgnJob;
+
+/* A sorted run of positions in a merge. The positions are either
+   in a job's buffer, or they're read from a temporary file or from
+   the old book file.  */
+typedef struct _MergeRun
+{
+	FILE *fp;		/* temporary file or book file, or NULL */
+	int version;		/* version of the old book file <fp>, or 0 */
+	BookEntry *recs;	/* positions or moves */
+	size_t nrecs;		/* num. of positions in <recs> */
+	size_t index;		/* index of the next position */
+} MergeRun;
+
+/* Open a PGN reader at offset <offset> of a file.
+   Returns false if the file can't be opened.  */
+static bool
+open_reader(PgnReader *rd, const char *filename, long offset)
+{
+	ASSERT(1, rd != NULL);
+	ASSERT(1, filename != NULL);
+
+	if ((rd->fp = fopen(filename, "rb")) == NULL) {
+		my_perror("Can't open PGN file %s", filename);
+		return false;
+	}
+	if (fseek(rd->fp, offset, SEEK_SET) != 0) {
+		my_perror("Can't read PGN file %s", filename);
+		my_close(rd->fp, filename);
+		return false;
+	}
+	if ((rd->buf = malloc(PGN_BUF_SIZE)) == NULL)
+		fatal_error("Couldn't allocate memory");
+	rd->filename = filename;
+	rd->size = PGN_BUF_SIZE;
+	rd->len = 0;
+	rd->pos = 0;
+	rd->offset = offset;
+	rd->eof = false;
+
+	return true;
+}
+
+static void
+close_reader(PgnReader *rd)
+{
+	ASSERT(1, rd != NULL);
+
+	my_close(rd->fp, rd->filename);
+	free(rd->buf);
+	rd->buf = NULL;
+}
+
+/* Read more data to the buffer of a PGN reader. The unread bytes are
+   moved to the start of the buffer, and if they already fill it,
+   the buffer grows.
+   Returns false if there's nothing more to read.  */
+static bool
+fill_reader(PgnReader *rd)
+{
+	size_t n;
+
+	ASSERT(2, rd != NULL);
+
+	if (rd->eof)
+		return false;
+	if (rd->pos > 0) {
+		rd->len -= rd->pos;
+		memmove(rd->buf, rd->buf + rd->pos, rd->len);
+		rd->offset += rd->pos;
+		rd->pos = 0;
+	} else if (rd->len == rd->size) {
+		char *tmp;
+		if ((tmp = realloc(rd->buf, rd->size * 2)) == NULL)
+			fatal_error("Couldn't allocate memory");
+		rd->buf = tmp;
+		rd->size *= 2;
+	}
+
+	n = fread(rd->buf + rd->len, 1, rd->size - rd->len, rd->fp);
+	if (n < rd->size - rd->len)
+		rd->eof = true;
+	rd->len += n;
+
+	return n > 0;
+}
+
+/* Returns the file offset of a string in the buffer of a PGN reader.  */
+static long
+get_offset(const PgnReader *rd, const char *str)
+{
+	ASSERT(2, rd != NULL);
+	ASSERT(2, str >= rd->buf && str <= rd->buf + rd->len);
+
+	return rd->offset + (long)(str - rd->buf);
+}
+
+/* Returns true if <c> is a white-space character. This is faster than
+   isspace(), which depends on the locale.  */
+static bool
+is_space(int c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* Returns true if <c> ends a SAN move or other movetext token.  */
+static bool
+is_delimiter(int c)
+{
+	switch (c) {
+	case ' ': case '\t': case '\n': case '\v': case '\f': case '\r':
+	case '[': case ']': case '{': case '}': case '(': case ')': case ';':
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Returns the length of the first line in <str>, or <n> if the line
+   doesn't end in the first <n> characters.  */
+static size_t
+find_line_end(const char *str, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (str[i] == '\n' || str[i] == '\r')
+			break;
+	}
+	return i;
+}
+
+/* Returns the length of a token of type <type> at the start of <str>,
+   or 0 if the token doesn't end in the first <n> characters.  */
+static size_t
+scan_token(PgnToken type, const char *str, size_t n)
+{
+	size_t i;
+	int nb = 1;	/* num. of open parentheses */
+
+	ASSERT(2, str != NULL);
+	ASSERT(2, n > 0);
+
+	switch (type) {
+	case TOK_TAG:
+		/* A tag pair takes the whole line. Skipping until the
+		   closing ']' wouldn't be safe because PGN files often
+		   have those pairs broken.  */
+		i = find_line_end(str, n);
+		return (i < n) ? i : 0;
+	case TOK_COMMENT:
+		if (*str == ';') {
+			i = find_line_end(str, n);
+			return (i < n) ? i : 0;
+		}
+		for (i = 1; i < n; i++) {
+			if (str[i] == '}')
+				return i + 1;
+		}
+		return 0;
+	case TOK_VARIATION:
+		for (i = 1; i < n; i++) {
+			if (str[i] == '(')
+				nb++;
+			else if (str[i] == ')' && --nb <= 0)
+				return i + 1;
+			/* Skip comments, they may have parentheses.  */
+			else if (str[i] == '{') {
+				while (++i < n && str[i] != '}')
+					;
+			}
+		}
+		return 0;
+	case TOK_SAN:
+	case TOK_OTHER:
+		for (i = 1; i < n; i++) {
+			int c = (unsigned char)str[i];
+			if (is_delimiter(c))
+				return i;
+			/* Move numbers like "1.e4" have no space.  */
+			if (type == TOK_OTHER && isalpha(c))
+				return i;
 		}
+		return 0;
+	default:
+		ASSERT(1, false);
+		return 0;
 	}
+}
+
+/* Read the next token from a PGN reader.
+   Returns the type of the token, or TOK_EOF at the end of the file.  */
+static PgnToken
+next_token(PgnReader *rd, StrView *token)
+{
+	ASSERT(2, rd != NULL);
+	ASSERT(2, token != NULL);
+
+	while (true) {
+		PgnToken type;
+		const char *str;
+		size_t len;
+		int c;
+
+		/* Skip leading spaces.  */
+		while (rd->pos < rd->len && is_space(rd->buf[rd->pos]))
+			rd->pos++;
+		if (rd->pos >= rd->len) {
+			if (!fill_reader(rd))
+				return TOK_EOF;
+			continue;
+		}
+
+		str = rd->buf + rd->pos;
+		c = (unsigned char)*str;
+		if (c == '[')
+			type = TOK_TAG;
+		else if (c == '{' || c == ';')
+			type = TOK_COMMENT;
+		else if (c == '(')
+			type = TOK_VARIATION;
+		else if (isalpha(c))
+			type = TOK_SAN;
+		else
+			type = TOK_OTHER;
 
-	return RESULT_ERROR;
+		/* If the token doesn't end in the buffer, read more. At the
+		   end of the file the token takes the rest of the file.  */
+		if ((len = scan_token(type, str, rd->len - rd->pos)) == 0) {
+			if (fill_reader(rd))
+				continue;
+			str = rd->buf + rd->pos;
+			len = rd->len - rd->pos;
+		}
+		token->str = str;
+		token->len = len;
+		rd->pos += len;
+
+		return type;
+	}
+}
+
+/* Read the next line from a PGN reader.
+   Returns false at the end of the file.  */
+static bool
+next_line(PgnReader *rd, StrView *line)
+{
+	ASSERT(2, rd != NULL);
+	ASSERT(2, line != NULL);
+
+	while (true) {
+		size_t n = rd->len - rd->pos;
+		size_t len = find_line_end(rd->buf + rd->pos, n);
+
+		if (len >= n && fill_reader(rd))
+			continue;
+		if (rd->pos >= rd->len)
+			return false;
+
+		line->str = rd->buf + rd->pos;
+		line->len = len;
+		rd->pos += len;
+		/* Skip the line break.  */
+		if (rd->pos < rd->len)
+			rd->pos++;
+
+		return true;
+	}
+}
+
+/* Returns the game result of a tag pair, or RESULT_ERROR if the tag
+   isn't a Result tag.  */
+static PgnResult
+get_tag_result(const StrView *tag)
+{
+	const char *val;
+	size_t n;
+
+	ASSERT(2, tag != NULL);
+
+	if (tag->len < 8 || memcmp(tag->str, "[Result ", 8) != 0)
+		return RESULT_ERROR;
+	if ((val = memchr(tag->str, '"', tag->len)) == NULL)
+		return NO_RESULT;
+	n = tag->len - (++val - tag->str);
+
+	if (n >= 3 && !memcmp(val, "1-0", 3))
+		return WHITE_WINS;
+	if (n >= 3 && !memcmp(val, "0-1", 3))
+		return BLACK_WINS;
+	if (n >= 7 && !memcmp(val, "1/2-1/2", 7))
+		return DRAWN_GAME;
+	return NO_RESULT;
 }
 
-/* Read a move string from a stream.
-   Returns the length of the string if successfull (a move string is found).
-   Returns -1 if EOF is reached, or 0 if the word isn't a move string.  */
+/* Returns the offset of the first game that starts after offset <pos>
+   in a PGN file, or <file_len> if there are no more games.
+   A game starts with a tag line that follows a line of movetext.  */
+static long
+find_game_start(const char *filename, long pos, long file_len)
+{
+	bool prev_tag = true;
+	long start = file_len;
+	StrView line;
+	PgnReader rd;
+
+	ASSERT(1, filename != NULL);
+
+	if (!open_reader(&rd, filename, pos))
+		return file_len;
+
+	/* Skip the rest of the line at <pos>.  */
+	next_line(&rd, &line);
+	while (next_line(&rd, &line)) {
+		/* Skip empty lines.  */
+		if (line.len == 0)
+			continue;
+		if (line.str[0] == '[') {
+			if (!prev_tag) {
+				start = get_offset(&rd, line.str);
+				break;
+			}
+			prev_tag = true;
+		} else
+			prev_tag = false;
+	}
+	close_reader(&rd);
+
+	return start;
+}
+
+/* Compare two book entries by their keys and moves, for qsort().  */
 static int
-read_move(char *word, int lim, FILE *fp)
+compare_recs(const void *a, const void *b)
 {
-	int i;
-	int c;
+	const BookEntry *rec1 = (const BookEntry*)a;
+	const BookEntry *rec2 = (const BookEntry*)b;
 
-	/* Skip leading spaces.  */
-	do {
-		c = fgetc(fp);
-	} while (isspace(c));
+	if (rec1->key != rec2->key)
+		return (rec1->key < rec2->key) ? -1 : 1;
+	if (rec1->move != rec2->move)
+		return (rec1->move < rec2->move) ? -1 : 1;
+	return 0;
+}
 
-	if (c == EOF)
-		return -1;
+/* Sort the positions of an import job and sum the duplicates.  */
+static void
+reduce_recs(PgnJob *job)
+{
+	size_t i;
+	size_t n = 0;
+	BookEntry *recs = job->recs;
 
-	/* Save the first character of the word.  */
-	*word++ = (char)c;
+	ASSERT(1, job != NULL);
 
-	/* The word is not a move string.  */
-	if (!isalpha(c)) {
-		/* If the line starts with a '[' we skip the whole line.
-		   Skipping until the closing ']' wouldn't be safe because
-		   PGN files often have those pairs broken.  */
-		if (c == '[')
-			clear_buf(fp);
-		/* Skip everything inside brackets.  */
-		else if (c == '(' || c == '{') {
-			int open_b = c;	/* opening bracket */
-			int close_b;	/* closing bracket */
-			int nb = 1;	/* num. of brackets */
-			if (c == '(')
-				close_b = ')';
+	if (job->nrecs == 0)
+		return;
+	qsort(recs, job->nrecs, sizeof(BookEntry), compare_recs);
+	for (i = 1; i < job->nrecs; i++) {
+		if (recs[i].key == recs[n].key && recs[i].move == recs[n].move) {
+			recs[n].games += recs[i].games;
+			recs[n].wins += recs[i].wins;
+			recs[n].draws += recs[i].draws;
+		} else
+			recs[++n] = recs[i];
+	}
+	job->nrecs = n + 1;
+}
+
+/* Write the positions of an import job to a temporary file, and
+   empty the job's buffer.  */
+static void
+spill_recs(PgnJob *job)
+{
+	FILE *fp;
+	FILE **runs;
+
+	ASSERT(1, job != NULL);
+
+	runs = realloc(job->runs, (job->nruns + 1) * sizeof(FILE*));
+	if (runs == NULL)
+		fatal_error("Couldn't allocate memory");
+	job->runs = runs;
+
+	if ((fp = tmpfile()) == NULL) {
+		my_perror("Can't create a temporary file");
+		job->error = true;
+	} else if (fwrite(job->recs, sizeof(BookEntry), job->nrecs, fp)
+	           != job->nrecs) {
+		my_perror("Can't write to a temporary file");
+		job->error = true;
+		fclose(fp);
+	} else {
+		rewind(fp);
+		job->runs[job->nruns++] = fp;
+	}
+	job->nrecs = 0;
+}
+
+/* Add a position or a move to the buffer of an import job. <points>
+   is 2 for a win, 1 for a draw and 0 for a loss.  */
+static void
+add_rec(PgnJob *job, U64 key, U16 move, int points)
+{
+	BookEntry *rec;
+
+	ASSERT(2, job != NULL);
+
+	if (job->nrecs >= job->size) {
+		reduce_recs(job);
+		/* Grow the buffer if reducing didn't free enough space,
+		   or write it to a file if it's already at the limit.  */
+		if (job->size > 0 && job->size == job->max_size
+		&&  job->nrecs > job->size / 2)
+			spill_recs(job);
+		else if (job->size == 0 || job->nrecs > job->size / 2) {
+			if (job->size == 0)
+				job->size = REC_BUF_SIZE;
 			else
-				close_b = '}';
-			while ((c = fgetc(fp)) != EOF) {
-				if (c == open_b)
-					nb++;
-				else if (c == close_b && --nb <= 0)
+				job->size *= 2;
+			if (job->max_size > 0 && job->size > job->max_size)
+				job->size = job->max_size;
+			rec = realloc(job->recs, job->size * sizeof(BookEntry));
+			if (rec == NULL)
+				fatal_error("Couldn't allocate memory");
+			job->recs = rec;
+		}
+	}
+	rec = &job->recs[job->nrecs++];
+	rec->key = key;
+	rec->move = move;
+	rec->weight = 0;
+	rec->games = 1;
+	rec->wins = (points == 2);
+	rec->draws = (points == 1);
+}
+
+/* Read the games of an import job, and store the positions
+   in the job's buffer.  */
+static void
+parse_pgn_job(PgnJob *job)
+{
+	PgnResult result = NO_RESULT;
+	PgnToken type;
+	bool in_moves = true;	/* the last token was movetext */
+	bool replay = false;	/* store the positions of the game */
+	int depth = 0;
+	int prev_progress = 0;
+	StrView token;
+	PgnReader rd;
+	Board board;
+
+	ASSERT(1, job != NULL);
+
+	if (!open_reader(&rd, job->filename, job->start)) {
+		job->error = true;
+		return;
+	}
+
+	while ((type = next_token(&rd, &token)) != TOK_EOF) {
+		char san_move[MAX_BUF];
+		int points = 0;
+		U32 move;
+
+		if (type == TOK_TAG) {
+			PgnResult tag_result;
+
+			/* A new game begins. It belongs to the next job if
+			   it starts at or after the next job's first game.  */
+			if (in_moves) {
+				long offset = get_offset(&rd, token.str);
+				if (offset >= job->end)
 					break;
+				in_moves = false;
+				result = NO_RESULT;
+
+				if (job->show_progress && job->end > job->start) {
+					int progress = ((offset - job->start) * 50)
+					             / (job->end - job->start);
+					if (progress > prev_progress) {
+						progressbar(50, progress);
+						prev_progress = progress;
+					}
+				}
+			}
+			if ((tag_result = get_tag_result(&token)) != RESULT_ERROR) {
+				result = tag_result;
+				job->ngames++;
 			}
+			continue;
 		}
-		return 0;
+
+		/* The movetext of a game begins. Games with an unknown
+		   result are ignored, and so are drawn games if the book
+		   has no draw counts.  */
+		if (!in_moves) {
+			in_moves = true;
+			replay = (result == WHITE_WINS || result == BLACK_WINS
+			      || (result == DRAWN_GAME && job->version > 1));
+			if (replay) {
+				depth = 0;
+				fen_to_board(&board, START_FEN);
+			}
+		}
+		if (type != TOK_SAN || !replay)
+			continue;
+		/* Ignore move suffix annotations like "!?".  */
+		while (token.len > 0 && (token.str[token.len - 1] == '!'
+		||                       token.str[token.len - 1] == '?'))
+			token.len--;
+		if (token.len < 2 || token.len >= MAX_BUF)
+			continue;
+
+		memcpy(san_move, token.str, token.len);
+		san_move[token.len] = '\0';
+		move = san_to_move(&board, san_move);
+		if (move == NULLMOVE) {
+			#if DEBUG_LEVEL > 0
+			update_log("Illegal move in %s: %s, offset: %ld\n",
+			          job->filename, san_move,
+			          get_offset(&rd, token.str));
+			#endif /* DEBUG_LEVEL > 0 */
+			replay = false;
+			continue;
+		}
+
+		if ((result == WHITE_WINS && board.color == WHITE)
+		||  (result == BLACK_WINS && board.color == BLACK))
+			points = 2;
+		else if (result == DRAWN_GAME)
+			points = 1;
+
+		/* A version 2 book has the moves, and a version 1 book
+		   has the positions after them.  */
+		if (job->version > 1)
+			add_rec(job, board.posp->key, PACK_MOVE(move), points);
+		make_move(&board, move);
+		if (job->version == 1)
+			add_rec(job, board.posp->key, 0, points);
+
+		if (++depth >= MAX_BOOK_PLIES)
+			replay = false;
 	}
-	/* Get the rest of the move string.  */
-	for (i = 1; i < lim - 1; i++) {
-		c = fgetc(fp);
-		if (isspace(c))
+	close_reader(&rd);
+	reduce_recs(job);
+}
+
+#ifdef USE_THREADS
+/* The starting point for the threads that read PGN files.  */
+static tfunc_t
+pgn_threadfunc(void *data)
+{
+	parse_pgn_job((PgnJob*)data);
+
+	return 0;
+}
+#endif /* USE_THREADS */
+
+/* Returns the next position or move in a merge run.  */
+#define RUN_REC(run) (&(run)->recs[(run)->index])
+
+/* Make sure that the next position of a merge run is in memory.
+   Returns false if the run has no more positions.  */
+static bool
+fill_run(MergeRun *run)
+{
+	ASSERT(2, run != NULL);
+
+	if (run->index < run->nrecs)
+		return true;
+	if (run->fp == NULL)
+		return false;
+	if (run->version > 0) {
+		BookEntry *rec = run->recs;
+		for (run->nrecs = 0; run->nrecs < RUN_BUF_SIZE; run->nrecs++) {
+			if (!read_book_entry(run->fp, run->version, rec))
+				break;
+			rec++;
+		}
+	} else
+		run->nrecs = fread(run->recs, sizeof(BookEntry),
+		                   RUN_BUF_SIZE, run->fp);
+	run->index = 0;
+
+	return run->nrecs > 0;
+}
+
+/* Move the run at <i> down in a binary min-heap of merge runs,
+   ordered by their next key and move.  */
+static void
+sift_down(MergeRun **heap, int nheap, int i)
+{
+	MergeRun *run = heap[i];
+
+	while (true) {
+		int child = i * 2 + 1;
+		if (child >= nheap)
+			break;
+		if (child + 1 < nheap
+		&&  compare_recs(RUN_REC(heap[child + 1]),
+		                 RUN_REC(heap[child])) < 0)
+			child++;
+		if (compare_recs(RUN_REC(run), RUN_REC(heap[child])) <= 0)
 			break;
-		*word++ = (char)c;
+		heap[i] = heap[child];
+		i = child;
 	}
-	*word = '\0';
-
-	return i;
+	heap[i] = run;
 }
 
-#if DEBUG_LEVEL > 0
-/* Returns the line number of the current position in a stream.  */
+/* Merge sorted runs of positions, and sum the counters of each
+   position. The positions are added to an AVL tree, or if <tree> is
+   NULL, they're written to a book file with <bw>.
+   Returns the number of new positions (positions that aren't in the
+   tree or in the old book run), or -1 if the file can't be written.  */
 static int
-get_line_num(FILE *fp)
-{
-	int line_num;
-	long pos;
-	long end_pos;
-	
-	ASSERT(1, fp != NULL);
-	
-	end_pos = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-	pos = ftell(fp);
-	line_num = 1;
-	while (pos < end_pos) {
-		int c = fgetc(fp);
-		if (c == EOF || c == '\0')
+merge_runs(MergeRun *runs, int nruns, AvlNode **tree, struct _BookWriter *bw)
+{
+	int i;
+	int npos = 0;
+	int nheap = 0;
+	MergeRun **heap;
+
+	ASSERT(1, runs != NULL);
+	ASSERT(1, tree != NULL || bw != NULL);
+
+	if ((heap = malloc(nruns * sizeof(MergeRun*))) == NULL)
+		fatal_error("Couldn't allocate memory");
+	for (i = 0; i < nruns; i++) {
+		if (fill_run(&runs[i]))
+			heap[nheap++] = &runs[i];
+	}
+	for (i = nheap / 2 - 1; i >= 0; i--)
+		sift_down(heap, nheap, i);
+
+	while (nheap > 0) {
+		BookEntry entry = *RUN_REC(heap[0]);
+		bool is_new = (heap[0]->version == 0);
+
+		entry.games = 0;
+		entry.wins = 0;
+		entry.draws = 0;
+		/* Sum the position's counters from all the runs.  */
+		while (nheap > 0 && compare_recs(RUN_REC(heap[0]), &entry) == 0) {
+			MergeRun *run = heap[0];
+			if (run->version > 0)
+				is_new = false;
+			entry.games += RUN_REC(run)->games;
+			entry.wins += RUN_REC(run)->wins;
+			entry.draws += RUN_REC(run)->draws;
+			run->index++;
+			if (!fill_run(run))
+				heap[0] = heap[--nheap];
+			if (nheap > 0)
+				sift_down(heap, nheap, 0);
+		}
+
+		if (tree != NULL) {
+			if (add_book_entry(&entry, tree))
+				npos++;
+		} else if (write_book_entry(bw, &entry)) {
+			if (is_new)
+				npos++;
+		} else {
+			npos = -1;
 			break;
-		if (c == '\n')
-			line_num++;
-		pos++;
+		}
+	}
+	free(heap);
+
+	return npos;
+}
+
+/* Merge the positions of the import jobs into an AVL tree, or if
+   <tree> is NULL, merge them with the old book file <book> (if not
+   NULL) and write them to a new book file with <bw>. The book file's
+   format is <version>.
+   Returns the same value as merge_runs().  */
+static int
+merge_jobs(PgnJob *jobs, int njobs, AvlNode **tree,
+           FILE *book, int version, struct _BookWriter *bw)
+{
+	int i;
+	int j;
+	int npos;
+	int nruns = 1;
+	MergeRun *runs;
+
+	ASSERT(1, jobs != NULL);
+
+	for (i = 0; i < njobs; i++)
+		nruns += jobs[i].nruns + 1;
+	if ((runs = calloc(nruns, sizeof(MergeRun))) == NULL)
+		fatal_error("Couldn't allocate memory");
+
+	nruns = 0;
+	for (i = 0; i < njobs; i++) {
+		for (j = 0; j < jobs[i].nruns; j++)
+			runs[nruns++].fp = jobs[i].runs[j];
+		runs[nruns].recs = jobs[i].recs;
+		runs[nruns++].nrecs = jobs[i].nrecs;
+	}
+	if (book != NULL) {
+		runs[nruns].fp = book;
+		runs[nruns++].version = version;
+	}
+	for (i = 0; i < nruns; i++) {
+		if (runs[i].fp == NULL)
+			continue;
+		runs[i].recs = malloc(RUN_BUF_SIZE * sizeof(BookEntry));
+		if (runs[i].recs == NULL)
+			fatal_error("Couldn't allocate memory");
+	}
+
+	npos = merge_runs(runs, nruns, tree, bw);
+
+	for (i = 0; i < nruns; i++) {
+		if (runs[i].fp != NULL)
+			free(runs[i].recs);
+	}
+	free(runs);
+
+	return npos;
+}
+
+/* Free the import jobs and their temporary files.  */
+static void
+free_jobs(PgnJob *jobs, int njobs)
+{
+	int i;
+	int j;
+
+	ASSERT(1, jobs != NULL);
+
+	for (i = 0; i < njobs; i++) {
+		for (j = 0; j < jobs[i].nruns; j++)
+			fclose(jobs[i].runs[j]);
+		free(jobs[i].runs);
+		free(jobs[i].recs);
 	}
-	
-	return line_num;
+	free(jobs);
+}
+
+/* Create settings.nthreads import jobs for a book whose format is
+   <version>. Each job keeps at most <max_recs> / njobs positions in
+   memory, or if <max_recs> is 0, there's no limit.
+   Returns the jobs, and their number in <njobs>.  */
+static PgnJob *
+create_jobs(int *njobs, size_t max_recs, int version)
+{
+	int i;
+	PgnJob *jobs;
+
+	ASSERT(1, njobs != NULL);
+
+	*njobs = 1;
+#ifdef USE_THREADS
+	if (settings.nthreads > 1)
+		*njobs = settings.nthreads;
+#endif /* USE_THREADS */
+	if ((jobs = calloc(*njobs, sizeof(PgnJob))) == NULL)
+		fatal_error("Couldn't allocate memory");
+	for (i = 0; i < *njobs; i++) {
+		jobs[i].version = version;
+		jobs[i].max_size = max_recs / *njobs;
+	}
+
+	return jobs;
+}
+
+/* Split a PGN file at game boundaries between the import jobs, and
+   read the parts in parallel. The positions are added to the ones
+   the jobs already have.
+   Returns false on error.  */
+static bool
+read_pgn_file(PgnJob *jobs, int njobs, const char *filename)
+{
+	int i;
+	long file_len;
+	FILE *fp;
+
+	ASSERT(1, jobs != NULL);
+	ASSERT(1, filename != NULL);
+
+	if ((fp = fopen(filename, "rb")) == NULL) {
+		my_perror("Can't open PGN file %s", filename);
+		return false;
+	}
+	/* Find out how big the file is.  */
+	fseek(fp, 0, SEEK_END);
+	file_len = ftell(fp);
+	my_close(fp, filename);
+
+	for (i = 0; i < njobs; i++) {
+		jobs[i].filename = filename;
+		jobs[i].start = 0;
+		jobs[i].end = file_len;
+		if (i > 0) {
+			long pos = (file_len / njobs) * i;
+			jobs[i].start = find_game_start(filename, pos, file_len);
+			if (jobs[i].start < jobs[i - 1].start)
+				jobs[i].start = jobs[i - 1].start;
+			jobs[i - 1].end = jobs[i].start;
+		}
+	}
+	jobs[0].show_progress = true;
+
+	printf("Reading PGN file %s...\n", filename);
+	progressbar(50, 0);
+#ifdef USE_THREADS
+	if (njobs > 1) {
+		thread_t *threads;
+
+		if ((threads = calloc(njobs, sizeof(thread_t))) == NULL)
+			fatal_error("Couldn't allocate memory");
+		for (i = 0; i < njobs; i++) {
+			if (t_create(pgn_threadfunc, (void*)&jobs[i],
+			             &threads[i]) != 0)
+				break;
+		}
+		if (i > 0)
+			join_threads(threads, i);
+		/* Parse the parts whose threads couldn't be created.  */
+		for (; i < njobs; i++)
+			parse_pgn_job(&jobs[i]);
+		free(threads);
+	} else
+#endif /* USE_THREADS */
+		parse_pgn_job(&jobs[0]);
+	progressbar(50, 50);
+	printf("\n");
+
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].error)
+			return false;
+	}
+
+	return true;
+}
+
+/* Print the number of games read by import jobs, and the import speed.  */
+static void
+print_import_speed(const PgnJob *jobs, int njobs, S64 timer)
+{
+	int i;
+	int ngames = 0;
+	S64 ms;
+
+	ASSERT(1, jobs != NULL);
+
+	for (i = 0; i < njobs; i++)
+		ngames += jobs[i].ngames;
+	if ((ms = get_ms() - timer) < 1)
+		ms = 1;
+	printf("%d games read (%.0f games/sec)\n",
+	       ngames, (double)ngames * 1000.0 / ms);
 }
-#endif /* DEBUG_LEVEL > 0 */
 
 /* Read a PGN file (a collection of one or more games in PGN format) and store
    the positions and their win/loss ratios in an AVL tree (**tree).
    The AVL tree can later be written in an opening book file (book.bin).
+
+   The file is split at game boundaries into settings.nthreads parts
+   which are read in parallel.
    
    Returns the number of new positions added to the tree, or -1 on error.  */
 int
 pgn_to_tree(const char *filename, AvlNode **tree)
 {
-	PgnResult result;
-	int prev_progress;
-	int npos = 0;
-	long file_len;
-	FILE *fp;
-	Board board;
+	int njobs;
+	int npos = -1;
+	S64 timer;
+	PgnJob *jobs;
 
 	ASSERT(1, filename != NULL);
+	ASSERT(1, tree != NULL);
 
-	if ((fp = fopen(filename, "r")) == NULL) {
+	if (!file_exists(filename)) {
 		my_perror("Can't open PGN file %s", filename);
 		return -1;
 	}
-
-	if (settings.book_type != BOOK_MEM) {
-		settings.book_type = BOOK_MEM;
-		printf("Changed book mode to \"book in memory\"\n");
-	}
 	if (*tree == NULL && file_exists(settings.book_file)) {
 		printf("Loading opening book to memory...\n");
 		book_to_tree(settings.book_file, tree);
 	} else if (*tree == NULL)
 		printf("Creating a new opening book...\n");
 
-	/* Find out how big the file is.  */
-	fseek(fp, 0, SEEK_END);
-	file_len = ftell(fp);
-	rewind(fp);
+	timer = get_ms();
+	jobs = create_jobs(&njobs, 0, get_book_version());
+	if (read_pgn_file(jobs, njobs, filename)) {
+		npos = merge_jobs(jobs, njobs, tree, NULL, 0, NULL);
+		print_import_speed(jobs, njobs, timer);
+	}
+	free_jobs(jobs, njobs);
 
-	printf("Reading PGN file %s...\n", filename);
-	prev_progress = 0;
-	progressbar(50, 0);
-	while ((result = get_pgn_result(fp)) != RESULT_ERROR) {
-		int depth;
-		int progress;
-		int len;
-		char san_move[MAX_BUF];
+	return npos;
+}
 
-		/* Games with an unknown result are ignored.  */
-		ASSERT(1, result != RESULT_ERROR);
-		if (result == NO_RESULT || result == DRAWN_GAME)
-			continue;
+/* Open the old book file <filename> for merging, and read its header.
+   The format version of the book is stored in <version>.
+   Returns the file, or NULL on error.  */
+static FILE *
+open_old_book(const char *filename, int *version)
+{
+	FILE *fp;
 
-		depth = 0;
-		fen_to_board(&board, START_FEN);
+	ASSERT(1, filename != NULL);
+	ASSERT(1, version != NULL);
 
-		while ((len = read_move(san_move, MAX_BUF, fp)) >= 0) {
-			int points = 0;
-			U32 move;
+	if ((fp = fopen(filename, "rb")) == NULL) {
+		my_perror("Can't open file %s", filename);
+		return NULL;
+	}
+	if ((*version = read_book_header(fp, NULL)) == -1) {
+		my_error("Invalid book file %s", filename);
+		my_close(fp, filename);
+		return NULL;
+	}
 
-			/* break out of the loop when a new game begins */
-			if (depth > 0 && san_move[0] == '[')
-				break;
-			if (len < 2)
-				continue;
+	return fp;
+}
 
-			move = san_to_move(&board, san_move);
-			if (move == NULLMOVE) {
-				#if DEBUG_LEVEL > 0
-				update_log("Illegal move in %s: %s, line: %d\n",
-				          filename, san_move, get_line_num(fp));
-				#endif /* DEBUG_LEVEL > 0 */
-				break;
-			}
+/* Read PGN files and write their positions to the opening book file
+   <book_file> without building an AVL tree. If <merge> is true, the
+   positions are merged with the old book file in one pass, and the book
+   keeps its format version. Otherwise the old book is replaced with a
+   book of the current version. The positions are sorted in temporary
+   files, so the memory usage is limited even with huge PGN files. The new
+   book is first written to a temporary file, which then replaces
+   <book_file>. The book file is locked only for the merge, so that
+   other Sloppy processes can update it while the PGN files are read.
 
-			if ((result == WHITE_WINS && board.color == WHITE)
-			||  (result == BLACK_WINS && board.color == BLACK))
-				points = 2;
+   Returns the number of new positions in the book, or -1 on error.  */
+int
+pgn_to_book(const char * const *filenames, int nfiles,
+            const char *book_file, bool merge)
+{
+	int i;
+	int njobs;
+	int npos = -1;
+	int version = BOOK_VERSION;
+	int old_version;
+	S64 timer;
+	FILE *book = NULL;
+	PgnJob *jobs;
+	struct _BookWriter *bw = NULL;
 
-			make_move(&board, move);
-			if (save_book_pos(board.posp->key, points, tree))
-				npos++;
+	ASSERT(1, filenames != NULL);
+	ASSERT(1, book_file != NULL);
 
-			if (++depth >= MAX_BOOK_PLIES)
-				break;
-		}
-		progress = (ftell(fp) * 50) / file_len;
-		if (progress > prev_progress) {
-			progressbar(50, progress);
-			prev_progress = progress;
-		}
+	merge = merge && file_exists(book_file);
+	if (merge) {
+		if ((book = open_old_book(book_file, &version)) == NULL)
+			return -1;
+		my_close(book, book_file);
+		book = NULL;
 	}
-	progressbar(50, 50);
-	my_close(fp, filename);
-	printf("\n");
+
+	timer = get_ms();
+	jobs = create_jobs(&njobs, BUILD_BUF_SIZE, version);
+	for (i = 0; i < nfiles; i++) {
+		if (!read_pgn_file(jobs, njobs, filenames[i]))
+			break;
+	}
+	if (i < nfiles || !lock_book(book_file)) {
+		free_jobs(jobs, njobs);
+		return -1;
+	}
+
+	/* The book may have been replaced while the files were read.  */
+	old_version = version;
+	if (merge)
+		book = open_old_book(book_file, &old_version);
+	if (merge && book == NULL)
+		npos = -1;
+	else if (old_version != version)
+		my_error("The format of book file %s has changed", book_file);
+	else if ((bw = open_book_writer(book_file, version)) != NULL) {
+		print_import_speed(jobs, njobs, timer);
+		printf("Writing the book...\n");
+		npos = merge_jobs(jobs, njobs, NULL, book, version, bw);
+	}
+	free_jobs(jobs, njobs);
+	if (book != NULL)
+		my_close(book, book_file);
+
+	if (bw != NULL && !close_book_writer(bw))
+		npos = -1;
+	unlock_book();
 
 	return npos;
 }
-
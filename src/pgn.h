@@ -11,5 +11,15 @@ struct _AvlNode;
    Returns the number of new positions added to the tree, or -1 on error.  */
 extern int pgn_to_tree(const char *filename, struct _AvlNode **tree);
 
+/* Read PGN files and write their positions to the opening book file
+   <book_file> without building an AVL tree. If <merge> is true, the
+   positions are merged with the old book file in one pass, otherwise
+   the old book is replaced. The memory usage is limited even with huge
+   PGN files, because the positions are sorted in temporary files.
+
+   Returns the number of new positions in the book, or -1 on error.  */
+extern int pgn_to_book(const char * const *filenames, int nfiles,
+                       const char *book_file, bool merge);
+
 #endif /* PGN_H */
 
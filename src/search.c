@@ -60,41 +60,84 @@ static const int prom_threat[64] = {
 
 static U32 killer[MAX_PLY][2];
 
+/* Move selection stages in search().  */
+typedef enum _MoveStage
+{
+	STAGE_HASH,		/* the hash move */
+	STAGE_GEN_CAPTS,	/* generate captures */
+	STAGE_GOOD_CAPTS,	/* captures with a non-negative SEE */
+	STAGE_KILLERS,		/* killer moves */
+	STAGE_GEN_QUIETS,	/* generate non-captures */
+	STAGE_QUIETS,		/* non-captures */
+	STAGE_BAD_CAPTS,	/* captures with a negative SEE */
+	STAGE_EVASIONS,		/* all legal moves when in check */
+	STAGE_DONE
+} MoveStage;
+
+/* Staged move generation: moves are generated in stages so that in
+   most nodes only the hash move, or a few captures, are needed before
+   a cutoff.  */
+typedef struct _MovePicker
+{
+	MoveStage stage;
+	int ply;
+	int index;		/* index of the next move in the list */
+	int nkillers;		/* num. of killer slots tried */
+	int mg_flags;		/* flags for the move generators */
+	U32 hash_move;
+	U32 killers[2];		/* validated killers that were tried */
+	MoveLst capts;		/* captures */
+	MoveLst moves;		/* non-captures, or all moves in check */
+} MovePicker;
+
 
 /* Static function prototypes.  */
 static int search(Chess *chess, int alpha, int beta, int depth, bool in_pv, PvLine *pv);
 
 
-/* Get the next best (highest move ordering score) move from a list.  */
-static U32
-get_next_move(MoveLst *move_list, int index)
+/* Sort a scored move list in descending order of move ordering scores.
+   The moves are partitioned by score: those with BAD_SCORE (usually most
+   of the moves) are all equal and they're always the lowest, so they're
+   left alone at the end of the list. Only the short part of hash moves,
+   captures, killers and checks is sorted, with a selection sort that
+   keeps the move order identical to picking the best move one by one.  */
+static void
+sort_moves(MoveLst *move_list)
 {
 	int i;
-	int best_i = -1;
-	int best_score = -VAL_INF;
-	U32 best_move;
-	
+	int index;
+	int *score;
+	U32 *move;
+
 	ASSERT(2, move_list != NULL);
-	ASSERT(2, index >= 0 && index < move_list->nmoves);
 
-	for (i = index; i < move_list->nmoves; i++) {
-		if (move_list->score[i] > best_score) {
-			best_score = move_list->score[i];
-			best_i = i;
+	score = move_list->score;
+	move = move_list->move;
+	for (index = 0; index < move_list->nmoves; index++) {
+		int best_i = index;
+		int best_score = score[index];
+		U32 best_move;
+
+		for (i = index + 1; i < move_list->nmoves; i++) {
+			if (score[i] > best_score) {
+				best_score = score[i];
+				best_i = i;
+			}
+		}
+		/* The rest of the moves are all bad.  */
+		if (best_score == BAD_SCORE)
+			break;
+		if (best_i > index) {
+			best_move = move[best_i];
+			move[best_i] = move[index];
+			move[index] = best_move;
+			score[best_i] = score[index];
+			score[index] = best_score;
 		}
 	}
-	best_move = move_list->move[best_i];
-	if (best_i > index) {
-		move_list->move[best_i] = move_list->move[index];
-		move_list->move[index] = best_move;
-		move_list->score[best_i] = move_list->score[index];
-		move_list->score[index] = best_score;
-	}
-
-	return best_move;
 }
 
-/* Give move ordering scores to the moves in a list.  */
+/* Give move ordering scores to the moves in a list, and sort it.  */
 static void
 score_moves(const Board *board, U32 hash_move, int ply, MoveLst *move_list)
 {
@@ -123,11 +166,14 @@ score_moves(const Board *board, U32 hash_move, int ply, MoveLst *move_list)
 		else
 			*scorep = BAD_SCORE;
 	}
+	sort_moves(move_list);
 }
 
-/* Give quiescence search move ordering scores to the moves in a list.  */
+/* Give quiescence search move ordering scores to the moves in a list,
+   and sort it. If the list was generated with the MG_GOOD_SEE flag in
+   <mg_flags>, the captures already have their SEE score.  */
 static void
-score_qs_moves(const Board *board, MoveLst *move_list)
+score_qs_moves(const Board *board, MoveLst *move_list, int mg_flags)
 {
 	int i;
 	int *scorep;
@@ -141,7 +187,8 @@ score_qs_moves(const Board *board, MoveLst *move_list)
 		scorep = &move_list->score[i];
 		
 		if (GET_CAPT(move) || GET_PROM(move)) {
-			*scorep = see(board, move, board->color);
+			if (!(mg_flags & MG_GOOD_SEE))
+				*scorep = see(board, move, board->color);
 			if (*scorep <= -VAL_PAWN)
 				*scorep = BAD_SCORE;
 		} else if (IS_CHECK(move))
@@ -149,6 +196,151 @@ score_qs_moves(const Board *board, MoveLst *move_list)
 		else
 			*scorep = BAD_SCORE;
 	}
+	sort_moves(move_list);
+}
+
+/* Initialize a move picker for search(). If the side to move is in check,
+   <mp->moves> must already contain all the legal moves.  */
+static void
+init_move_picker(MovePicker *mp, const Board *board, U32 hash_move, int ply)
+{
+	ASSERT(2, mp != NULL);
+	ASSERT(2, board != NULL);
+
+	mp->ply = ply;
+	mp->index = 0;
+	mp->nkillers = 0;
+	mp->mg_flags = settings.pseudo_legal ? MG_PSEUDO : 0;
+	mp->killers[0] = NULLMOVE;
+	mp->killers[1] = NULLMOVE;
+
+	mp->hash_move = validate_move(board, hash_move);
+	if (board->posp->in_check) {
+		score_moves(board, mp->hash_move, ply, &mp->moves);
+		mp->stage = STAGE_EVASIONS;
+	} else
+		mp->stage = STAGE_HASH;
+}
+
+/* Returns true if <move> was already tried in a previous stage.  */
+static bool
+move_is_tried(const MovePicker *mp, U32 move)
+{
+	return (move == mp->hash_move
+	||      move == mp->killers[0] || move == mp->killers[1]);
+}
+
+/* Get the next move from a move picker, and assign its move ordering
+   score to <score>. Returns NULLMOVE when there are no moves left.
+   Pseudo-legal moves are verified only when they're picked, so the
+   moves after a cutoff are never tested for legality.  */
+static U32
+next_move(MovePicker *mp, const Board *board, int *score)
+{
+	int i;
+	U32 move;
+
+	ASSERT(2, mp != NULL);
+	ASSERT(2, board != NULL);
+	ASSERT(2, score != NULL);
+
+	switch (mp->stage) {
+	case STAGE_HASH:
+		mp->stage = STAGE_GEN_CAPTS;
+		if (mp->hash_move != NULLMOVE) {
+			*score = BEST_SCORE;
+			return mp->hash_move;
+		}
+		/* Fall through.  */
+	case STAGE_GEN_CAPTS:
+		gen_qs_moves(board, &mp->capts, mp->mg_flags);
+		for (i = 0; i < mp->capts.nmoves; i++)
+			mp->capts.score[i] =
+				see(board, mp->capts.move[i], board->color);
+		sort_moves(&mp->capts);
+		mp->index = 0;
+		mp->stage = STAGE_GOOD_CAPTS;
+		/* Fall through.  */
+	case STAGE_GOOD_CAPTS:
+		while (mp->index < mp->capts.nmoves) {
+			move = mp->capts.move[mp->index];
+			/* Losing captures are left for the last stage.  */
+			if (mp->capts.score[mp->index] < 0)
+				break;
+			*score = mp->capts.score[(mp->index)++];
+			if ((mp->mg_flags & MG_PSEUDO)
+			&&  (move = verify_move(board, move)) == NULLMOVE)
+				continue;
+			if (move != mp->hash_move)
+				return move;
+		}
+		mp->stage = STAGE_KILLERS;
+		/* Fall through.  */
+	case STAGE_KILLERS:
+		while (mp->nkillers < 2) {
+			i = (mp->nkillers)++;
+			move = validate_move(board, killer[mp->ply][i]);
+			if (move == NULLMOVE || GET_CAPT(move)
+			||  move_is_tried(mp, move))
+				continue;
+			mp->killers[i] = move;
+			*score = KILLER_SCORE - i;
+			return move;
+		}
+		mp->stage = STAGE_GEN_QUIETS;
+		/* Fall through.  */
+	case STAGE_GEN_QUIETS:
+		gen_quiet_moves(board, &mp->moves, mp->mg_flags);
+		score_moves(board, NULLMOVE, mp->ply, &mp->moves);
+		mp->stage = STAGE_QUIETS;
+		i = mp->index;
+		mp->index = 0;
+		/* The bad captures continue where the good ones ended.  */
+		mp->capts.nmoves -= i;
+		memmove(mp->capts.move, mp->capts.move + i,
+		        mp->capts.nmoves * sizeof(U32));
+		memmove(mp->capts.score, mp->capts.score + i,
+		        mp->capts.nmoves * sizeof(int));
+		/* Fall through.  */
+	case STAGE_QUIETS:
+		while (mp->index < mp->moves.nmoves) {
+			move = mp->moves.move[mp->index];
+			*score = mp->moves.score[(mp->index)++];
+			/* The quiet moves already have the IS_CHECK bit.  */
+			if ((mp->mg_flags & MG_PSEUDO)
+			&&  !move_is_legal(board, move))
+				continue;
+			if (!move_is_tried(mp, move))
+				return move;
+		}
+		mp->index = 0;
+		mp->stage = STAGE_BAD_CAPTS;
+		/* Fall through.  */
+	case STAGE_BAD_CAPTS:
+		while (mp->index < mp->capts.nmoves) {
+			move = mp->capts.move[mp->index];
+			*score = mp->capts.score[(mp->index)++];
+			if ((mp->mg_flags & MG_PSEUDO)
+			&&  (move = verify_move(board, move)) == NULLMOVE)
+				continue;
+			if (move != mp->hash_move)
+				return move;
+		}
+		mp->stage = STAGE_DONE;
+		break;
+	case STAGE_EVASIONS:
+		if (mp->index < mp->moves.nmoves) {
+			move = mp->moves.move[mp->index];
+			*score = mp->moves.score[(mp->index)++];
+			return move;
+		}
+		mp->stage = STAGE_DONE;
+		break;
+	case STAGE_DONE:
+		break;
+	}
+
+	return NULLMOVE;
 }
 
 /* Returns true if the side to move is in checkmate.  */
@@ -223,6 +415,7 @@ qs_search(Chess *chess, int alpha, int beta, int depth)
 	int val;
 	int i;
 	int ply;
+	int mg_flags = 0;
 	Board *board;
 	MoveLst move_list;
 	
@@ -269,31 +462,34 @@ qs_search(Chess *chess, int alpha, int beta, int depth)
 			alpha = val;
 		}
 
-		if (depth >= 0) {
-			gen_moves(board, &move_list);
-			if (move_list.nmoves == 0)
-				return VAL_DRAW;
-		} else {
-			gen_qs_moves(board, &move_list);
-			/* Now we have a possible stalemate, but since this
-		   	   is the quiescence search we just don't care.  */
-			if (move_list.nmoves == 0)
-				return alpha;
-		}
+		/* Checks are tried only on the first ply.  */
+		mg_flags = MG_PROMS | MG_GOOD_SEE;
+		if (depth >= 0)
+			mg_flags |= MG_CHECKS;
+		if (settings.pseudo_legal)
+			mg_flags |= MG_PSEUDO;
+		gen_qs_moves(board, &move_list, mg_flags);
+		/* Now we have a possible stalemate, but since this
+		   is the quiescence search we just don't care.  */
+		if (move_list.nmoves == 0)
+			return alpha;
 	}
 	/* If we're in check we should search all moves.  */
 	else {
-		gen_moves(board, &move_list);
+		gen_evasions(board, &move_list);
 		if (move_list.nmoves == 0)
 			return MATE(ply);
 		//depth++;
 	}
 	
-	score_qs_moves(board, &move_list);
+	score_qs_moves(board, &move_list, mg_flags);
 	for (i = 0; i < move_list.nmoves; i++) {
-		U32 move = get_next_move(&move_list, i);
+		U32 move = move_list.move[i];
 		if (!in_check && move_list.score[i] == BAD_SCORE)
 			return alpha;
+		if ((mg_flags & MG_PSEUDO)
+		&&  (move = verify_move(board, move)) == NULLMOVE)
+			continue;
 
 		make_move(board, move);
 		val = -qs_search(chess, -beta, -alpha, depth - 1);
@@ -371,6 +567,7 @@ null_move_pruning(Chess *chess, int beta, int *depth, bool in_pv)
 		return false;
 
 	make_nullmove(board);
+	prefetch_hash(board->posp->key);
 	val = -search(chess, -beta, -beta + 1, *depth - NULL_R, false, NULL);
 	undo_nullmove(board);
 	
@@ -379,11 +576,10 @@ null_move_pruning(Chess *chess, int beta, int *depth, bool in_pv)
 		return false;
 
 	if (val >= beta) {
-		int rply = sd->root_ply;
-		int ply = board->nmoves - rply;
+		int ply = board->nmoves - sd->root_ply;
 		int hval = val_to_hash(beta, ply);
 		U64 key = board->posp->key;
-		store_hash(*depth, hval, H_BETA, key, NULLMOVE, rply);
+		store_hash(*depth, hval, H_BETA, key, NULLMOVE);
 		return true;
 	} else if (val < -VAL_LIM_MATE)
 		(*depth)++;
@@ -404,7 +600,7 @@ iid(Chess *chess, int alpha, int beta, int depth)
 	if (val <= alpha)
 		val = search(chess, -VAL_INF, beta, depth, true, NULL);
 
-	return get_hash_move(chess->sboard.posp->key);
+	return get_hash_move(&chess->sboard);
 }
 
 /* Check for new input or timeup.  */
@@ -454,7 +650,7 @@ search(Chess *chess, int alpha, int beta, int depth, bool in_pv, PvLine *pv)
 	U32 best_move = NULLMOVE;
 	bool in_check;
 	bool avoid_null = false;
-	MoveLst move_list;
+	MovePicker mp;
 	PvLine tmp_pv;
 	PvLine *new_pv = NULL;
 	int i;
@@ -462,7 +658,8 @@ search(Chess *chess, int alpha, int beta, int depth, bool in_pv, PvLine *pv)
 	int ply;
 	int best_val = -VAL_INF;
 	int fut_score = VAL_INF;
-	U32 hash_move;
+	U32 move;
+	int score;
 
 	ASSERT(2, chess != NULL);
 	ASSERT(2, alpha >= -VAL_INF);
@@ -500,7 +697,7 @@ search(Chess *chess, int alpha, int beta, int depth, bool in_pv, PvLine *pv)
 		return val;
 
 	/* Transposition table lookup.  */
-	val = probe_hash(depth, alpha, beta, key, &best_move, ply);
+	val = probe_hash(board, depth, alpha, beta, &best_move, ply);
 	(sd->nhash_probes)++;
 	switch (val) {
 	case VAL_NONE:
@@ -537,14 +734,16 @@ search(Chess *chess, int alpha, int beta, int depth, bool in_pv, PvLine *pv)
 	ASSERT(2, depth > 0);
 	in_check = board->posp->in_check;
 
-	gen_moves(board, &move_list);
-	if (move_list.nmoves == 0) {
-		if (in_check)
+	/* When in check all the legal moves are generated at once, so
+	   single replies can be extended.  */
+	if (in_check) {
+		gen_evasions(board, &mp.moves);
+		if (mp.moves.nmoves == 0)
 			return MATE(ply);
-		return VAL_DRAW;
-	} else if (move_list.nmoves == 1) {
-		depth++;
-		best_move = move_list.move[0];
+		else if (mp.moves.nmoves == 1) {
+			depth++;
+			best_move = mp.moves.move[0];
+		}
 	}
 
 	/* Internal Iterative Deepening (IID).  */
@@ -554,20 +753,18 @@ search(Chess *chess, int alpha, int beta, int depth, bool in_pv, PvLine *pv)
 			return VAL_NONE;
 	}
 
-	score_moves(board, best_move, ply, &move_list);
+	init_move_picker(&mp, board, best_move, ply);
 
 	orig_alpha = alpha;
-	hash_move = best_move;
 
-	for (i = 0; i < move_list.nmoves; i++) {
+	for (i = 0; (move = next_move(&mp, board, &score)) != NULLMOVE; i++) {
 		bool reduced;
 		int new_depth;
-		U32 move = get_next_move(&move_list, i);
 		bool extend = IS_CHECK(move) || PAWN_THREAT(move) ||
-		              is_recapture(board, move, move_list.score[i]);
+		              is_recapture(board, move, score);
 		bool tactical = extend || GET_CAPT(move) ||
-		                is_passer_move(board, move);
-		bool bad_score = (move_list.score[i] == BAD_SCORE);
+		              is_passer_move(board, move);
+		bool bad_score = (score == BAD_SCORE);
 
 		/* Futility pruning.  */
 		if (depth < 3 && !in_check && !tactical && !in_pv
@@ -586,6 +783,10 @@ search(Chess *chess, int alpha, int beta, int depth, bool in_pv, PvLine *pv)
 		new_depth = depth - 1;
 
 		make_move(board, move);
+		/* search() probes the hash table after a few tests, but
+		   qs_search() doesn't probe it at all, so the hash bucket
+		   is prefetched here instead of in make_move().  */
+		prefetch_hash(board->posp->key);
 
 		if (extend)
 			new_depth++;
@@ -623,7 +824,7 @@ search(Chess *chess, int alpha, int beta, int depth, bool in_pv, PvLine *pv)
 			}
 
 			store_hash(depth, val_to_hash(beta, ply), H_BETA,
-			           key, move, sd->root_ply);
+			           key, move);
 			return beta;
 		}
 		if (val > best_val) {
@@ -636,13 +837,17 @@ search(Chess *chess, int alpha, int beta, int depth, bool in_pv, PvLine *pv)
 		}
 	}
 
+	/* No legal moves, it's a stalemate.  */
+	if (i == 0)
+		return VAL_DRAW;
+
 	/* Fail low.  */
 	if (alpha <= orig_alpha)
 		store_hash(depth, val_to_hash(alpha, ply), H_ALPHA,
-		           key, best_move, sd->root_ply);
+		           key, best_move);
 	else	/* Exact score.  */
 		store_hash(depth, val_to_hash(alpha, ply), H_EXACT,
-		           key, best_move, sd->root_ply);
+		           key, best_move);
 
 	return alpha;
 }
@@ -681,7 +886,7 @@ search_root(Chess *chess, int depth, U32 *movep)
 	if (*movep != NULLMOVE)
 		best_move = *movep;
 	else {
-		best_move = get_hash_move(key);
+		best_move = get_hash_move(board);
 		(sd->nhash_probes)++;
 		if (best_move != NULLMOVE)
 			(sd->nhash_hits)++;
@@ -694,11 +899,12 @@ search_root(Chess *chess, int depth, U32 *movep)
 	for (i = 0; i < move_list.nmoves; i++) {
 		bool extend;
 		int new_depth;
-		U32 move = get_next_move(&move_list, i);
+		U32 move = move_list.move[i];
 
 		sd->nmoves_left = move_list.nmoves - i;
 		move_to_san(sd->san_move, board, move);
 		make_move(board, move);
+		prefetch_hash(board->posp->key);
 		
 		extend = IS_CHECK(move) || PAWN_THREAT(move);
 		new_depth = depth - 1;
@@ -718,7 +924,7 @@ search_root(Chess *chess, int depth, U32 *movep)
 		if (sd->stop_search && *movep != NULLMOVE && i > 0) {
 			*movep = best_move;
 			store_hash(depth, val_to_hash(alpha, 0), H_BETA,
-			           key, best_move, sd->root_ply);
+			           key, best_move);
 		}
 		if (sd->stop_search)
 			return VAL_NONE;
@@ -733,7 +939,7 @@ search_root(Chess *chess, int depth, U32 *movep)
 
 	*movep = best_move;
 	store_hash(depth, val_to_hash(alpha, 0), H_EXACT,
-	           key, best_move, sd->root_ply);
+	           key, best_move);
 
 	if (get_ms() > sd->deadline)
 		sd->strict_deadline = sd->deadline;
@@ -768,12 +974,16 @@ print_pv(const Chess *chess, int depth, int score, U64 nnodes)
 	if (chess->protocol == PROTO_NONE) {
 		int minutes = t_elapsed / 60000;
 		int seconds = (t_elapsed % 60000) / 1000;
+		HashStats hstats;
+
 		printf("%2d  ", depth);
 		if (score >= 0)
 			printf("+");
 		printf("%.2f  ", (double)score / 100.0);
+		get_hash_stats(&hstats);
 		printf("%.2d:%.2d  ", minutes, seconds);
 		printf("%10" PRIu64 " ", nnodes);
+		printf("%5.1f%% ", hstats.full / 10.0);
 	} else if (chess->protocol == PROTO_XBOARD) {
 		int csec = t_elapsed / 10;
 		printf("%d %d %d %" PRIu64, depth, score, csec, nnodes);
@@ -790,7 +1000,7 @@ print_pv(const Chess *chess, int depth, int score, U64 nnodes)
 			/* If the pv isn't long enough (i.e. because a forced
 			   mate was found) we try to find the moves by looking
 			   inside the hash table. */
-			move = get_hash_move(tmp_board.posp->key);
+			move = get_hash_move(&tmp_board);
 
 		/* It's very rare, but possible, that both the PvLine and the
 		   hash table fail to provide us a complete pv.  */
@@ -888,6 +1098,7 @@ id_search(Chess *chess, U32 test_move)
 	sd->root_ply = board->nmoves;
 	sd->move = NULLMOVE;
 
+	new_hash_generation();
 	init_killers();
 	for (depth = 1; depth <= chess->max_depth; depth++) {
 		sd->ply = depth;
@@ -94,6 +94,15 @@ typedef uint64_t U64;
 #define GET_CASTLE(a)	((a & 02000000000) >> 28)	/* castling type */
 #define IS_CHECK(a)	((a & 04000000000) >> 29)
 
+/* Specs for a compact 16-bit move, used in the hash table:
+   from		bits 1 - 6
+   to		bits 7 - 12
+   promotion	bits 13 - 15
+
+   The rest of the move can be restored with unpack_move() (movegen.c)
+   if the board position is known.  */
+#define PACK_MOVE(a)	((U16)((a & 0000007777) | (GET_PROM(a) << 12)))
+
 /* Starting position for a chess game, in FEN format.  */
 #define START_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
 
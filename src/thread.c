@@ -6,11 +6,12 @@
 #ifdef WINDOWS
 
 /* Create a new Windows thread.  */
-void
+int
 t_create(LPTHREAD_START_ROUTINE func, void *arg, thread_t *thrd)
 {
 	DWORD iID;
 	*thrd = CreateThread(NULL, 0, func, arg, 0, &iID);
+	return (*thrd == NULL) ? -1 : 0;
 }
 
 /* Wait for Windows threads to finish.  */
@@ -19,7 +19,7 @@
 	#define mutex_lock(x) EnterCriticalSection(x)
 	#define mutex_unlock(x) LeaveCriticalSection(x)
 
-	extern void t_create(LPTHREAD_START_ROUTINE func, void *arg, thread_t *thrd);
+	extern int t_create(LPTHREAD_START_ROUTINE func, void *arg, thread_t *thrd);
 #else /* not WINDOWS */
 	#include <pthread.h>
 
@@ -47,7 +47,7 @@ const Castling castling = {
 };
 
 Settings settings = {
-	0x200000,	/* hash size (num. of entries) */
+	0x120000,	/* hash size (num. of 32-byte buckets in 36 MB) */
 	4,		/* egbb_max_men */
 	EGBB_OFF,	/* egbb load type */
 	0x400000,	/* egbb cache size (bytes) */
@@ -56,7 +56,8 @@ Settings settings = {
 	-1,		/* num. of threads */
 	BOOK_MEM,	/* book mode */
 	true,		/* book learning */
-	false		/* logfile */
+	false,		/* logfile */
+	true		/* pseudo-legal move generation */
 };
 
 static int rand_seed = 1;	/* seed for the random number generator */
@@ -482,113 +483,66 @@ fix_endian_u64(U64 val)
 }
 
 
-#if defined(__GNUC__) && (defined(__LP64__) || defined(__powerpc64__))
-
-/* Locates the first (least significant) "one" bit in a bitboard.
-   Optimized for x86-64.  */
-int
-get_lsb(U64 b)
-{
-	U64 ret;
-	__asm__
-	(
-        "bsfq %[b], %[ret]"
-        :[ret] "=r" (ret)
-        :[b] "mr" (b)
-	);
-	return (int)ret;
-}
-
-#else /* not 64-bit GNUC */
-
-/* Locates the first (least significant) "one" bit in a bitboard.
-   Optimized for x86.  */
-int
-get_lsb(U64 b)
-{
-	unsigned a;
-	/* Based on code by Lasse Hansen.  */
-	static const int lsb_table[32] = {
-		31,  0,  9,  1, 10, 20, 13,  2,
-		 7, 11, 21, 23, 17, 14,  3, 25,
-		30,  8, 19, 12,  6, 22, 16, 24,
-		29, 18,  5, 15, 28,  4, 27, 26
-	};
-
-	ASSERT(2, b != 0);
-
-	a = (unsigned)b;
-	if (a != 0)
-		return lsb_table[((a & -(int)a) * 0xe89b2be) >> 27];
-	a  =  (unsigned)(b >> 32);
-
-	return lsb_table[((a & -(int)a) * 0xe89b2be) >> 27]  +  32;
-}
-
-#endif /* not 64-bit GNUC */
-
-
-#if defined(__LP64__) || defined(__powerpc64__) || defined(_WIN64)
-
-/* Returns the number of "one" bits in a 64-bit word.
-   Optimized for x86-64.  */
-int
-popcount(U64 b)
-{
-	b = (b & 0x5555555555555555) + ((b >> 1) & 0x5555555555555555);
-	b = (b & 0x3333333333333333) + ((b >> 2) & 0x3333333333333333);
-	b = (b + (b >> 4)) & 0x0F0F0F0F0F0F0F0F;
-	b = b + (b >> 8);
-	b = b + (b >> 16);
-	b = (b + (b >> 32)) & 0x0000007F;
-
-	return (int)b;
-}
-#else /* not 64-bit */
-
-/* From R. Scharnagl
+/* Lookup table for the software version of get_lsb().  */
+const int lsb_table[32] = {
+	31,  0,  9,  1, 10, 20, 13,  2,
+	 7, 11, 21, 23, 17, 14,  3, 25,
+	30,  8, 19, 12,  6, 22, 16, 24,
+	29, 18,  5, 15, 28,  4, 27, 26
+};
 
-   Returns the number of "one" bits in a 64-bit word.
-   Endian independent form.
-   Optimized for 32-bit processors.  */
-int
-popcount(U64 b)
+void
+check_cpu_features(void)
 {
-	unsigned buf;
-	unsigned acc;
-
-	if (b == 0)
-		return 0;
-
-	buf = (unsigned)b;
-	acc = buf;
-	acc -= ((buf &= 0xEEEEEEEE) >> 1);
-	acc -= ((buf &= 0xCCCCCCCC) >> 2);
-	acc -= ((buf &= 0x88888888) >> 3);
-	buf = (unsigned)(b >> 32);
-	acc += buf;
-	acc -= ((buf &= 0xEEEEEEEE) >> 1);
-	acc -= ((buf &= 0xCCCCCCCC) >> 2);
-	acc -= ((buf &= 0x88888888) >> 3);
-	acc = (acc & 0x0F0F0F0F) + ((acc >> 4) & 0x0F0F0F0F);
-	acc = (acc & 0xFFFF) + (acc >> 16);
-
-	return (acc & 0xFF) + (acc >> 8);
+/* Clang has __builtin_cpu_supports() with the "bmi" and "bmi2" features
+   since version 6.  */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+ && (!defined(__clang__) || __clang_major__ >= 6)
+	__builtin_cpu_init();
+  #ifdef __POPCNT__
+	if (!__builtin_cpu_supports("popcnt"))
+		fatal_error("This build of %s requires a cpu with POPCNT",
+		            APP_NAME);
+  #endif /* __POPCNT__ */
+  #ifdef __BMI__
+	if (!__builtin_cpu_supports("bmi"))
+		fatal_error("This build of %s requires a cpu with BMI",
+		            APP_NAME);
+  #endif /* __BMI__ */
+  #ifdef __BMI2__
+	if (!__builtin_cpu_supports("bmi2"))
+		fatal_error("This build of %s requires a cpu with BMI2",
+		            APP_NAME);
+  #endif /* __BMI2__ */
+#elif defined(_MSC_VER) && defined(__POPCNT__)
+	int info[4];
+
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 23)))
+		fatal_error("This build of %s requires a cpu with POPCNT",
+		            APP_NAME);
+#endif
 }
-#endif /* not 64-bit */
 
-/* Same as get_lsb(), but also clears the first bit in *b.  */
-int
-pop_lsb(U64 *b)
+const char *
+get_bitop_info(void)
 {
-	int lsb;
-
-	ASSERT(2, b != NULL);
-	
-	lsb = get_lsb(*b);
-	*b &= (*b - 1);
-
-	return lsb;
+#if defined(__GNUC__) && defined(__BMI__)
+  #define BITSCAN_INFO "TZCNT"
+#elif (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))) \
+   || (defined(_MSC_VER) && defined(_WIN64))
+  #define BITSCAN_INFO "BSF"
+#elif defined(__GNUC__)
+  #define BITSCAN_INFO "builtin"
+#else
+  #define BITSCAN_INFO "software"
+#endif
+#if defined(__POPCNT__)
+  #define POPCOUNT_INFO "POPCNT"
+#else
+  #define POPCOUNT_INFO "software"
+#endif
+	return "bitscan: " BITSCAN_INFO ", popcount: " POPCOUNT_INFO;
 }
 
 #if defined(WINDOWS) || defined(__GNUC__)
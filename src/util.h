@@ -9,6 +9,7 @@ typedef enum _BookType
 {
 	BOOK_MEM,	/* book is in memory */
 	BOOK_DISK,	/* book is accessed externally */
+	BOOK_MAP,	/* book file is mapped to memory */
 	BOOK_OFF	/* book is disabled */
 } BookType;
 
@@ -24,7 +25,7 @@ typedef enum _EgbbLoadType
 /* Sloppy's global settings.  */
 typedef struct _Settings
 {
-	size_t hash_size;		/* hash size (num. of entries) */
+	size_t hash_size;		/* hash size (num. of buckets) */
 	int egbb_max_men;		/* 4 or 5 */
 	EgbbLoadType egbb_load_type;
 	size_t egbb_cache_size;		/* egbb cache size in bytes */
@@ -34,6 +35,7 @@ typedef struct _Settings
 	BookType book_type;
 	bool use_learning;
 	bool use_log;
+	bool pseudo_legal;		/* pseudo-legal movegen in search */
 } Settings;
 
 /* Castle masks and squares for move generation, castle rights, etc.
@@ -129,14 +131,119 @@ extern U16 fix_endian_u16(U16 val);
 extern U32 fix_endian_u32(U32 val);
 extern U64 fix_endian_u64(U64 val);
 
+/* Check that the cpu supports the instructions (eg. POPCNT) that Sloppy
+   was compiled to use, and terminate with an error if it doesn't.  */
+extern void check_cpu_features(void);
+
+/* Returns a description of the bitscan and popcount implementations.  */
+extern const char *get_bitop_info(void);
+
+
+/* The bit operations are called from the innermost loops of the move
+   generators and evaluation, so they're inlined.
+   Hardware instructions are selected at compile time: POPCNT is used if
+   the compiler targets a cpu that has it (eg. GCC's -mpopcnt), or on
+   64-bit MSVC if USE_POPCNT is defined. With GCC's -mbmi the bitscan
+   uses TZCNT instead of BSF.  */
+#ifdef _MSC_VER
+  #include <intrin.h>
+  #define INLINE __inline
+  #if defined(_WIN64) && !defined(__POPCNT__) && defined(USE_POPCNT)
+    #define __POPCNT__
+  #endif
+#else /* not _MSC_VER */
+  #define INLINE inline
+#endif /* not _MSC_VER */
+
+/* Start loading the cache line at <addr> from memory, so that it's
+   already in the cache when it's needed. It's only a hint to the cpu.  */
+#if defined(__GNUC__)
+  #define PREFETCH(addr) __builtin_prefetch((addr))
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+  #define PREFETCH(addr) _mm_prefetch((const char *)(addr), _MM_HINT_T0)
+#else /* no prefetch instruction */
+  #define PREFETCH(addr)
+#endif /* no prefetch instruction */
+
+extern const int lsb_table[32];
+
 /* Locates the first (least significant) "one" bit in a bitboard.  */
-extern int get_lsb(U64 b);
+static INLINE int
+get_lsb(U64 b)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(b);
+#elif defined(_MSC_VER) && defined(_WIN64)
+	unsigned long ret;
+	_BitScanForward64(&ret, b);
+	return (int)ret;
+#else /* not GNUC or 64-bit MSVC */
+	/* Based on code by Lasse Hansen.  */
+	unsigned a;
+
+	a = (unsigned)b;
+	if (a != 0)
+		return lsb_table[((a & -(int)a) * 0xe89b2be) >> 27];
+	a  =  (unsigned)(b >> 32);
+
+	return lsb_table[((a & -(int)a) * 0xe89b2be) >> 27]  +  32;
+#endif /* not GNUC or 64-bit MSVC */
+}
 
 /* Same as get_lsb(), but also clears the first bit in *b.  */
-extern int pop_lsb(U64 *b);
+static INLINE int
+pop_lsb(U64 *b)
+{
+	int lsb;
+
+	lsb = get_lsb(*b);
+	*b &= (*b - 1);
+
+	return lsb;
+}
 
 /* Returns the number of "one" bits in a 64-bit word.  */
-extern int popcount(U64 b);
+static INLINE int
+popcount(U64 b)
+{
+#if defined(__POPCNT__) && defined(__GNUC__)
+	return __builtin_popcountll(b);
+#elif defined(__POPCNT__) && defined(_MSC_VER)
+	return (int)__popcnt64(b);
+#elif defined(__LP64__) || defined(__powerpc64__) || defined(_WIN64)
+	b = (b & 0x5555555555555555) + ((b >> 1) & 0x5555555555555555);
+	b = (b & 0x3333333333333333) + ((b >> 2) & 0x3333333333333333);
+	b = (b + (b >> 4)) & 0x0F0F0F0F0F0F0F0F;
+	b = b + (b >> 8);
+	b = b + (b >> 16);
+	b = (b + (b >> 32)) & 0x0000007F;
+
+	return (int)b;
+#else /* not 64-bit */
+	/* From R. Scharnagl. Endian independent form, optimized for
+	   32-bit processors.  */
+	unsigned buf;
+	unsigned acc;
+
+	if (b == 0)
+		return 0;
+
+	buf = (unsigned)b;
+	acc = buf;
+	acc -= ((buf &= 0xEEEEEEEE) >> 1);
+	acc -= ((buf &= 0xCCCCCCCC) >> 2);
+	acc -= ((buf &= 0x88888888) >> 3);
+	buf = (unsigned)(b >> 32);
+	acc += buf;
+	acc -= ((buf &= 0xEEEEEEEE) >> 1);
+	acc -= ((buf &= 0xCCCCCCCC) >> 2);
+	acc -= ((buf &= 0x88888888) >> 3);
+	acc = (acc & 0x0F0F0F0F) + ((acc >> 4) & 0x0F0F0F0F);
+	acc = (acc & 0xFFFF) + (acc >> 16);
+
+	return (acc & 0xFF) + (acc >> 8);
+#endif /* not 64-bit */
+}
 
 #if defined(WINDOWS) || defined(__GNUC__)
 /* A replacement for strncpy().
@@ -400,7 +400,7 @@ read_xb_input(Chess *chess)
 		if (settings.book_type != BOOK_OFF)
 			move = get_book_move(board, false, chess->book);
 		if (move == NULLMOVE)
-			move = get_hash_move(board->posp->key);
+			move = get_hash_move(board);
 		if (move != NULLMOVE) {
 			char san_move[MAX_BUF];
 			move_to_san(san_move, board, move);
@@ -445,10 +445,8 @@ read_xb_input(Chess *chess)
 		memory = atoi(param);
 		if (memory < 8 || memory > 1024)
 			printf("Hash size must be between 8 and 1024 MB.\n");
-		else {
-			set_hash_size(memory);
-			init_hash();
-		}
+		else
+			resize_hash(memory);
 		break;
 	case XBID_EGTPATH:
 		tok = strtok_r(NULL, " ", &param);